@@ -36,5 +36,16 @@
 
 #include "khash_mgmnt.h"
 #include "khash_utils.h"
+#include "khash_tss.h"
+#include "khash_filter.h"
+#include "khash_cache.h"
+#include "khash_hash.h"
+#include "khash_serial.h"
+#include "khash_pcpu.h"
+#include "khash_sketch.h"
+#include "khash_arena.h"
+#include "khash_pool.h"
+#include "khash_bpf.h"
+#include "khash_ctl.h"
 
 #endif
@@ -0,0 +1,329 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/llist.h>
+
+#include "khash.h"
+#include "khash_internal.h"
+
+#define KHASH_ARENA_FIRST \
+	ALIGN(sizeof(khash_arena_chunk_t), KHASH_ARENA_SLOT_SIZE)
+#define KHASH_ARENA_SLOTS \
+	((KHASH_ARENA_CHUNK_SIZE - KHASH_ARENA_FIRST) / KHASH_ARENA_SLOT_SIZE)
+
+__always_inline static khash_arena_chunk_t *
+khash_arena_chunk_of(const void *slot)
+{
+	return ((khash_arena_chunk_t *)((unsigned long)slot &
+			~(KHASH_ARENA_CHUNK_SIZE - 1)));
+}
+
+/* Movable entries are the ones khash allocated itself, as a whole */
+__always_inline static int
+khash_arena_movable(khash_item_t *item)
+{
+	return ((item->flags & (KHASH_ITEM_F_CACHE | KHASH_ITEM_F_ARENA)) &&
+			!(item->flags & (KHASH_ITEM_F_MULTI | KHASH_ITEM_F_INLINE)));
+}
+
+static void
+khash_arena_free(khash_arena_t *a)
+{
+	khash_arena_chunk_t *c = NULL, *next = NULL;
+
+	for (c = a->chunks; c; c = next) {
+		next = c->next;
+		free_pages((unsigned long)c, KHASH_ARENA_ORDER);
+	}
+
+	kfree(a);
+}
+
+void
+khash_arena_put(khash_arena_t *a)
+{
+	if (a && atomic_long_dec_and_test(&a->ref))
+		khash_arena_free(a);
+}
+
+/* Next slot of the head chunk: consecutive calls return adjacent slots */
+static void *
+khash_arena_carve(khash_arena_t *a, gfp_t flags)
+{
+	khash_arena_chunk_t *c = a->chunks;
+
+	if (!c || c->used == KHASH_ARENA_SLOTS) {
+		c = (khash_arena_chunk_t *)__get_free_pages(flags | __GFP_NOWARN,
+				KHASH_ARENA_ORDER);
+		if (unlikely(!c))
+			return (NULL);
+
+		c->next = a->chunks;
+		c->arena = a;
+		c->used = 0;
+		a->chunks = c;
+		WRITE_ONCE(a->nchunks, a->nchunks + 1);
+	}
+
+	a->slots++;
+
+	return ((uint8_t *)c + KHASH_ARENA_FIRST + c->used++ * KHASH_ARENA_SLOT_SIZE);
+}
+
+__always_inline static khash_item_t *
+khash_arena_item_init(khash_arena_t *a, void *slot, khash_key_t hash,
+		void *value)
+{
+	khash_item_t *item = slot;
+
+	atomic_long_inc(&a->ref);
+
+	memset(item, 0, sizeof(khash_item_t));
+	item->hash = hash;
+	item->value = value;
+	item->flags = KHASH_ITEM_F_ARENA;
+
+	return (item);
+}
+
+/* Writer side: recycled slots first, then carving */
+khash_item_t *
+khash_arena_item_new(khash_arena_t *a, khash_key_t hash, void *value,
+		gfp_t flags)
+{
+	struct llist_node *node = NULL;
+
+	if (!a->free)
+		a->free = llist_del_all(&a->freed);
+
+	if (a->free) {
+		node = a->free;
+		a->free = node->next;
+		return (khash_arena_item_init(a, node, hash, value));
+	}
+
+	node = khash_arena_carve(a, flags);
+	if (unlikely(!node))
+		return (NULL);
+
+	return (khash_arena_item_init(a, node, hash, value));
+}
+
+/* Nobody can reach @item anymore, any context */
+void
+khash_arena_item_free(khash_item_t *item)
+{
+	khash_arena_t *a = khash_arena_chunk_of(item)->arena;
+
+	llist_add((struct llist_node *)item, &a->freed);
+	khash_arena_put(a);
+}
+
+void
+khash_arena_item_free_rcu(struct rcu_head *rcu)
+{
+	khash_arena_item_free(container_of(rcu, khash_item_t, rcu));
+}
+
+/*
+ * Releases the chunks (but the head) whose every carved slot is on the
+ * free list; slots still on their way to freed keep theirs.
+ */
+static void
+khash_arena_shrink(khash_arena_t *a)
+{
+	struct llist_node *node = NULL, *tail = NULL, **pn = NULL;
+	khash_arena_chunk_t *c = NULL, **pc = NULL;
+	uint32_t nempty = 0;
+
+	if (!a->chunks)
+		return;
+
+	node = llist_del_all(&a->freed);
+	if (node) {
+		for (tail = node; tail->next; tail = tail->next)
+			;
+		tail->next = a->free;
+		a->free = node;
+	}
+
+	for (c = a->chunks; c; c = c->next)
+		c->nfree = 0;
+
+	for (node = a->free; node; node = node->next)
+		khash_arena_chunk_of(node)->nfree++;
+
+	for (c = a->chunks->next; c; c = c->next)
+		nempty += (c->nfree == c->used);
+
+	if (!nempty)
+		return;
+
+	for (pn = &a->free; *pn;) {
+		c = khash_arena_chunk_of(*pn);
+		if (c != a->chunks && c->nfree == c->used)
+			*pn = (*pn)->next;
+		else
+			pn = &(*pn)->next;
+	}
+
+	for (pc = &a->chunks->next; *pc;) {
+		c = *pc;
+		if (c->nfree != c->used) {
+			pc = &c->next;
+			continue;
+		}
+
+		*pc = c->next;
+		free_pages((unsigned long)c, KHASH_ARENA_ORDER);
+		WRITE_ONCE(a->nchunks, a->nchunks - 1);
+	}
+}
+
+int
+khash_arena_enable(khash_t *khash)
+{
+	khash_arena_t *a = NULL;
+
+	if (unlikely(!khash || khash->vsize))
+		return (-1);
+
+	if (khash->arena)
+		return (0);
+
+	a = kzalloc(sizeof(khash_arena_t), khash_gfp(khash, GFP_KERNEL));
+	if (unlikely(!a))
+		return (-1);
+
+	atomic_long_set(&a->ref, 1);
+	init_llist_head(&a->freed);
+
+	khash->arena = a;
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_arena_enable);
+
+/* Movable entries already adjacent in chain order (chunk breaks allowed) */
+static int
+khash_arena_chain_packed(struct hlist_head *head)
+{
+	khash_item_t *item = NULL, *prev = NULL;
+
+	KHASH_CHAIN_FOR_EACH(item, head) {
+		if (!khash_arena_movable(item))
+			continue;
+
+		if (!(item->flags & KHASH_ITEM_F_ARENA))
+			return (0);
+
+		if (prev && (uint8_t *)item != (uint8_t *)prev + KHASH_ARENA_SLOT_SIZE &&
+				(uint8_t *)item != (uint8_t *)khash_arena_chunk_of(item) +
+				KHASH_ARENA_FIRST)
+			return (0);
+
+		prev = item;
+	}
+
+	return (1);
+}
+
+/*
+ * Copy and replace: readers on the old entry keep following its hh.next,
+ * which hlist_replace_rcu() leaves pointing into the chain, and the old
+ * entry goes after a grace period. Key and value do not change: the
+ * filter stays valid, the front cache only has to forget the old entry.
+ */
+int
+khash_arena_compact(khash_t *khash, uint32_t *cursor, uint32_t budget,
+		gfp_t flags)
+{
+	khash_item_t *item = NULL, *copy = NULL;
+	struct hlist_node *tmp = NULL;
+	struct hlist_head *head = NULL;
+	khash_cache_t *cache = NULL;
+	khash_arena_t *a = NULL;
+	void *slot = NULL;
+	uint32_t n = 0;
+
+	if (unlikely(!khash || !khash->arena || !cursor || !budget))
+		return (-1);
+
+	a = khash->arena;
+	cache = khash_cache_get(khash);
+
+	for (; *cursor < khash->bck_size && n < budget; (*cursor)++) {
+		head = khash_bck_get(khash, *cursor);
+		if (hlist_empty(head) || khash_arena_chain_packed(head))
+			continue;
+
+		KHASH_CHAIN_FOR_EACH_SAFE(item, tmp, head) {
+			n++;
+			if (!khash_arena_movable(item))
+				continue;
+
+			slot = khash_arena_carve(a, khash_gfp(khash, flags));
+			if (unlikely(!slot))
+				return (-1);
+
+			copy = khash_arena_item_init(a, slot, item->hash, item->value);
+			hlist_replace_rcu(&item->hh, &copy->hh);
+			if (unlikely(cache))
+				khash_cache_inval(cache, item->hash);
+
+			khash_item_release(item);
+			a->moved++;
+		}
+	}
+
+	if (*cursor < khash->bck_size)
+		return (0);
+
+	*cursor = 0;
+	khash_arena_shrink(a);
+
+	return (1);
+}
+EXPORT_SYMBOL(khash_arena_compact);
+
+int
+khash_arena_stats_get(khash_t *khash, khash_arena_stats_t *stats)
+{
+	khash_arena_t *a = NULL;
+
+	if (unlikely(!khash || !stats || !khash->arena))
+		return (-1);
+
+	a = khash->arena;
+	stats->chunks = READ_ONCE(a->nchunks);
+	stats->slots = READ_ONCE(a->slots);
+	stats->live = atomic_long_read(&a->ref) - 1;
+	stats->moved = READ_ONCE(a->moved);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_arena_stats_get);
@@ -0,0 +1,56 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KHASH_ARENA_H
+#define KHASH_ARENA_H
+
+/*
+ * Arena backed entries: once enabled, the plain entries a table allocates
+ * itself (khash_addentry()) are carved from large naturally aligned chunks
+ * instead of the slab. khash_arena_compact() walks the buckets in order
+ * from *@cursor and copies the entries of every scattered chain into
+ * consecutive freshly carved slots, swapping them in with
+ * hlist_replace_rcu(): chain walks and full table iterations then mostly
+ * read sequential memory. Slab entries (KHASH_ITEM_F_CACHE: those from
+ * khash_item_new() and khash_bulk_prepare(), and the ones khash_addentry()
+ * falls back to when no chunk can be allocated) are moved into the arena
+ * as well; pool, inline and multi index entries never are.
+ *
+ * At most @budget entries are visited per call; it returns 1 when a pass
+ * completes (chunks left empty are then released), 0 when more remains
+ * and -1 on failure. Both are writers: they MUST be serialized with the
+ * others. The arena lives until khash_term().
+ */
+
+typedef struct {
+	uint32_t chunks;  /* Chunks held */
+	uint64_t slots;   /* Slots carved so far */
+	uint64_t live;    /* Entries allocated from the arena */
+	uint64_t moved;   /* Entries relocated by khash_arena_compact() */
+} khash_arena_stats_t;
+
+int khash_arena_enable(khash_t *khash); /* Requires non atomic context */
+int khash_arena_compact(khash_t *khash, uint32_t *cursor, uint32_t budget,
+		gfp_t flags);
+int khash_arena_stats_get(khash_t *khash, khash_arena_stats_t *stats);
+
+#endif
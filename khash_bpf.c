@@ -0,0 +1,218 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+
+#include "khash.h"
+#include "khash_internal.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0) && \
+	IS_ENABLED(CONFIG_DEBUG_INFO_BTF)
+
+static unsigned int bpf_selftest;
+module_param(bpf_selftest, uint, 0444);
+MODULE_PARM_DESC(bpf_selftest, "Register the table exercised by tools/bpf at load (0: off)");
+
+#define KHASH_BPF_TEST_NAME "khash_bpf_test"
+
+/* Test table values: the handle boxed in a separate allocation */
+typedef struct {
+	struct rcu_head rcu;
+	uint64_t handle;
+} khash_bpf_box_t;
+
+static khash_t *khash_bpf_test_kh;
+static DEFINE_SPINLOCK(khash_bpf_test_lock);
+
+static void *
+khash_bpf_box_new(void *priv, uint64_t handle, gfp_t flags)
+{
+	khash_bpf_box_t *box = NULL;
+
+	box = kmalloc(sizeof(khash_bpf_box_t), flags);
+	if (box)
+		box->handle = handle;
+
+	return (box);
+}
+
+static uint64_t
+khash_bpf_box_get(void *priv, void *value)
+{
+	return (((khash_bpf_box_t *)value)->handle);
+}
+
+static void
+khash_bpf_box_free(void *priv, void *value)
+{
+	khash_bpf_box_t *box = (khash_bpf_box_t *)value;
+
+	kfree_rcu(box, rcu);
+}
+
+/* Entries left at unload, already past their grace period */
+static int
+khash_bpf_box_dtor(khash_key_t hash, void *value, void *user_data)
+{
+	kfree(value);
+
+	return (0);
+}
+
+static const khash_ctl_ops_t khash_bpf_box_ops = {
+	.value_new  = khash_bpf_box_new,
+	.value_get  = khash_bpf_box_get,
+	.value_free = khash_bpf_box_free,
+};
+
+static int
+khash_bpf_selftest_init(void)
+{
+	if (!bpf_selftest)
+		return (0);
+
+	khash_bpf_test_kh = khash_init(KHASH_BCK_SIZE_1k);
+	if (unlikely(!khash_bpf_test_kh))
+		return (-ENOMEM);
+
+	if (khash_dtor_set(khash_bpf_test_kh, khash_bpf_box_dtor, NULL) < 0 ||
+			khash_ctl_register(KHASH_BPF_TEST_NAME, khash_bpf_test_kh,
+			&khash_bpf_test_lock, &khash_bpf_box_ops, NULL) < 0) {
+		khash_term(khash_bpf_test_kh);
+		khash_bpf_test_kh = NULL;
+		return (-EINVAL);
+	}
+
+	return (0);
+}
+
+static void
+khash_bpf_selftest_exit(void)
+{
+	if (!khash_bpf_test_kh)
+		return;
+
+	khash_ctl_unregister(KHASH_BPF_TEST_NAME);
+	khash_term(khash_bpf_test_kh);
+	khash_bpf_test_kh = NULL;
+}
+
+/*
+ * Native XDP may run with only BHs disabled: the RCU read side the table
+ * and the registry rely on is taken here, nesting is cheap.
+ */
+__bpf_kfunc_start_defs();
+
+__bpf_kfunc int
+bpf_khash_lookup(u32 id, u64 key, u32 hash, u32 flags, u64 *value)
+{
+	int ret;
+
+	rcu_read_lock();
+	ret = khash_ctl_bpf_lookup(id, key, hash, flags, value);
+	rcu_read_unlock();
+
+	return (ret);
+}
+
+__bpf_kfunc int
+bpf_khash_update(u32 id, u64 key, u32 hash, u32 flags, u64 value)
+{
+	int ret;
+
+	rcu_read_lock();
+	ret = khash_ctl_bpf_update(id, key, hash, flags, value);
+	rcu_read_unlock();
+
+	return (ret);
+}
+
+__bpf_kfunc int
+bpf_khash_delete(u32 id, u64 key, u32 hash, u32 flags)
+{
+	int ret;
+
+	rcu_read_lock();
+	ret = khash_ctl_bpf_delete(id, key, hash, flags);
+	rcu_read_unlock();
+
+	return (ret);
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(khash_bpf_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_khash_lookup)
+BTF_ID_FLAGS(func, bpf_khash_update)
+BTF_ID_FLAGS(func, bpf_khash_delete)
+BTF_KFUNCS_END(khash_bpf_kfunc_ids)
+
+static const struct btf_kfunc_id_set khash_bpf_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set = &khash_bpf_kfunc_ids,
+};
+
+int
+khash_bpf_init(void)
+{
+	int ret;
+
+	ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_XDP, &khash_bpf_kfunc_set);
+	if (ret)
+		return (ret);
+
+	ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_SCHED_CLS,
+			&khash_bpf_kfunc_set);
+	if (ret)
+		return (ret);
+
+	return (khash_bpf_selftest_init());
+}
+
+/* Module BTF sets go away with the module */
+void
+khash_bpf_exit(void)
+{
+	khash_bpf_selftest_exit();
+}
+
+#else
+
+int
+khash_bpf_init(void)
+{
+	return (0);
+}
+
+void
+khash_bpf_exit(void)
+{
+}
+
+#endif
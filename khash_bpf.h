@@ -0,0 +1,54 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KHASH_BPF_H
+#define KHASH_BPF_H
+
+/*
+ * BPF kfuncs on the tables named through khash_ctl_register(), for XDP and
+ * tc (SCHED_CLS) programs. Available on 6.9+ kernels built with BTF,
+ * compiled out otherwise.
+ *
+ * A table is addressed by the id returned by KHASH_CTL_IOC_ID; keys, flags
+ * (KHASH_CTL_F_HASH) and value handles are the ones of the ctl interface.
+ * As on the ctl device, kernel pointers never cross: lookup needs
+ * value_get() and update needs value_new(), -EOPNOTSUPP otherwise.
+ *
+ * The kfuncs take rcu_read_lock() themselves (native XDP may only have
+ * BHs disabled): lookup is lockless, update (insert or replace, as
+ * BPF_ANY) and delete take the owner lock and fail with -EOPNOTSUPP on
+ * tables registered without one. All of them return 0 or -errno.
+ *
+ * tools/bpf/veth_test.sh runs them over a veth pair, on the table that
+ * khash registers when loaded with bpf_selftest=1.
+ */
+
+#ifndef __KERNEL__
+extern int bpf_khash_lookup(__u32 id, __u64 key, __u32 hash, __u32 flags,
+		__u64 *value) __ksym;
+extern int bpf_khash_update(__u32 id, __u64 key, __u32 hash, __u32 flags,
+		__u64 value) __ksym;
+extern int bpf_khash_delete(__u32 id, __u64 key, __u32 hash,
+		__u32 flags) __ksym;
+#endif
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+
+#include "khash.h"
+#include "khash_internal.h"
+
+void
+khash_cache_free(khash_cache_t *c)
+{
+	if (!c)
+		return;
+
+	free_percpu(c->slot);
+	free_percpu(c->stats);
+	kfree(c->gen);
+	kfree(c);
+}
+
+static void
+khash_cache_free_rcu(struct rcu_head *rcu)
+{
+	khash_cache_free(container_of(rcu, khash_cache_t, rcu));
+}
+
+int
+khash_cache_enable(khash_t *khash, uint32_t nslots)
+{
+	khash_cache_t *c = NULL, *old = NULL;
+
+	if (unlikely(!khash || !nslots || nslots > KHASH_CACHE_MAX_SLOTS))
+		return (-1);
+
+	might_sleep();
+
+	nslots = roundup_pow_of_two(nslots);
+
+	c = kzalloc(sizeof(khash_cache_t), GFP_KERNEL);
+	if (unlikely(!c))
+		return (-1);
+
+	c->mask = nslots - 1;
+
+	c->gen = kcalloc(nslots, sizeof(uint32_t), GFP_KERNEL);
+	if (unlikely(!c->gen))
+		goto khash_cache_enable_fail;
+
+	c->slot = __alloc_percpu(nslots * sizeof(khash_cache_slot_t),
+			__alignof__(khash_cache_slot_t));
+	if (unlikely(!c->slot))
+		goto khash_cache_enable_fail;
+
+	c->stats = alloc_percpu(khash_cache_pcpu_t);
+	if (unlikely(!c->stats))
+		goto khash_cache_enable_fail;
+
+	old = khash_cache_get(khash);
+	rcu_assign_pointer(khash->cache, c);
+	if (old)
+		call_rcu(&old->rcu, khash_cache_free_rcu);
+
+	return (0);
+
+khash_cache_enable_fail:
+	khash_cache_free(c);
+	return (-1);
+}
+EXPORT_SYMBOL(khash_cache_enable);
+
+void
+khash_cache_disable(khash_t *khash)
+{
+	khash_cache_t *c = NULL;
+
+	if (unlikely(!khash))
+		return;
+
+	c = khash_cache_get(khash);
+	if (!c)
+		return;
+
+	RCU_INIT_POINTER(khash->cache, NULL);
+	call_rcu(&c->rcu, khash_cache_free_rcu);
+}
+EXPORT_SYMBOL(khash_cache_disable);
+
+/* Every slot goes stale with khash_flush() */
+void
+khash_cache_reset(khash_t *kh)
+{
+	khash_cache_t *c = khash_cache_get(kh);
+	uint32_t i;
+
+	if (!c)
+		return;
+
+	smp_wmb();
+	for (i = 0; i <= c->mask; i++)
+		WRITE_ONCE(c->gen[i], c->gen[i] + 1);
+}
+
+int
+khash_cache_stats_get(khash_t *khash, int cpu, khash_cache_stats_t *stats)
+{
+	khash_cache_pcpu_t *pcpu = NULL;
+	khash_cache_t *c = NULL;
+	int i;
+
+	if (unlikely(!khash || !stats || (cpu >= 0 && !cpu_possible(cpu))))
+		return (-1);
+
+	memset(stats, 0, sizeof(khash_cache_stats_t));
+
+	rcu_read_lock();
+	c = rcu_dereference(khash->cache);
+	if (!c) {
+		rcu_read_unlock();
+		return (-1);
+	}
+
+	for_each_possible_cpu(i) {
+		if (cpu >= 0 && cpu != i)
+			continue;
+
+		pcpu = per_cpu_ptr(c->stats, i);
+		stats->hits += pcpu->hits;
+		stats->misses += pcpu->misses;
+	}
+	rcu_read_unlock();
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_cache_stats_get);
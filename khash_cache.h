@@ -0,0 +1,45 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KHASH_CACHE_H
+#define KHASH_CACHE_H
+
+/*
+ * Optional per-CPU direct mapped cache of recent khash_lookup() hits,
+ * meant for skewed traffic where a few keys carry most of the lookups.
+ * @nslots is rounded up to a power of 2, at most 1024 slots per CPU.
+ *
+ * Enabling needs non atomic context and MUST be serialized with the
+ * table writers.
+ */
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+} khash_cache_stats_t;
+
+int khash_cache_enable(khash_t *khash, uint32_t nslots);
+void khash_cache_disable(khash_t *khash);
+/* @cpu < 0 sums all the CPUs */
+int khash_cache_stats_get(khash_t *khash, int cpu, khash_cache_stats_t *stats);
+
+#endif
@@ -0,0 +1,937 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+#include <linux/compat.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "khash.h"
+#include "khash_internal.h"
+
+/* Records copied in/out and processed under a single lock round */
+#define KHASH_CTL_CHUNK 256
+
+typedef struct {
+	struct list_head list;
+	char name[KHASH_CTL_NAME_LEN];
+	khash_t *kh;
+	spinlock_t *lock;
+	const khash_ctl_ops_t *ops;
+	void *priv;
+	struct dentry *dbg;
+	uint32_t id;
+} khash_ctl_entry_t;
+
+/* Read only snapshot, shared by the file and its mappings */
+typedef struct {
+	struct kref ref;
+	void *buf;
+	uint64_t size;
+} khash_ctl_snap_t;
+
+typedef struct {
+	struct mutex lock;
+	khash_ctl_snap_t *snap;
+} khash_ctl_file_t;
+
+typedef struct {
+	khash_ctl_entry_t *entry;
+	struct khash_snap_rec *rec;
+	uint32_t cap;
+	uint32_t n;
+} khash_ctl_snap_iter_t;
+
+/* Batches hold it for read, (un)registration for write */
+static DECLARE_RWSEM(khash_ctl_rwsem);
+static LIST_HEAD(khash_ctl_list);
+
+/* BPF side view of the list, by id; beyond the ids tables get none */
+static khash_ctl_entry_t __rcu *khash_ctl_ids[KHASH_CTL_MAX_IDS];
+
+/* debugfs: khash/<name>/, one directory per named table */
+static struct dentry *khash_ctl_dbg;
+
+static khash_ctl_entry_t *
+khash_ctl_find(const char *name)
+{
+	khash_ctl_entry_t *entry = NULL;
+
+	list_for_each_entry(entry, &khash_ctl_list, list) {
+		if (!strncmp(entry->name, name, KHASH_CTL_NAME_LEN))
+			return (entry);
+	}
+
+	return (NULL);
+}
+
+static int
+khash_ctl_mem_show(struct seq_file *m, void *v)
+{
+	khash_ctl_entry_t *entry = m->private;
+	khash_mem_t mem;
+	khash_footprint_t fp;
+
+	if (khash_mem_get(entry->kh, &mem) < 0 ||
+			khash_footprint_get(entry->kh, &fp) < 0)
+		return (-EINVAL);
+
+	seq_printf(m, "entries %d\n", khash_size(entry->kh));
+	seq_printf(m, "total %llu\n", mem.total);
+	seq_printf(m, "bck %llu\n", mem.bck);
+	seq_printf(m, "items %llu\n", mem.items);
+	seq_printf(m, "extra %llu\n", mem.extra);
+	seq_printf(m, "budget %llu\n", mem.budget);
+	seq_printf(m, "backing %s\n", khash_backing_str(fp.backing));
+
+	return (0);
+}
+DEFINE_SHOW_ATTRIBUTE(khash_ctl_mem);
+
+static int
+khash_ctl_hot_show(struct seq_file *m, void *v)
+{
+	khash_ctl_entry_t *entry = m->private;
+	khash_sketch_ent_t *top = NULL;
+	int i, n, bck;
+
+	top = kmalloc_array(KHASH_SKETCH_TOPK, sizeof(*top), GFP_KERNEL);
+	if (!top)
+		return (-ENOMEM);
+
+	for (bck = 0; bck < 2; bck++) {
+		n = khash_sketch_top_get(entry->kh, bck, top, KHASH_SKETCH_TOPK);
+		if (n < 0) {
+			seq_puts(m, "disabled\n");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (bck)
+				seq_printf(m, "bck %u count %llu err %llu\n", top[i].hash.key,
+						top[i].count, top[i].err);
+			else
+				seq_printf(m, "key %016llx:%08x count %llu err %llu\n",
+						top[i].hash.__key._64, top[i].hash.key, top[i].count,
+						top[i].err);
+		}
+	}
+
+	kfree(top);
+
+	return (0);
+}
+
+static int
+khash_ctl_hot_open(struct inode *inode, struct file *file)
+{
+	return (single_open(file, khash_ctl_hot_show, inode->i_private));
+}
+
+/* "<rate_shift>" (re)starts sampling 1 lookup in 2^rate_shift, "-1" stops */
+static ssize_t
+khash_ctl_hot_write(struct file *file, const char __user *buf, size_t len,
+		loff_t *ppos)
+{
+	khash_ctl_entry_t *entry = ((struct seq_file *)file->private_data)->private;
+	int shift, ret;
+
+	ret = kstrtoint_from_user(buf, len, 0, &shift);
+	if (ret)
+		return (ret);
+
+	if (shift < 0)
+		khash_sketch_disable(entry->kh);
+	else if (khash_sketch_enable(entry->kh, shift) < 0)
+		return (-EINVAL);
+
+	return (len);
+}
+
+static const struct file_operations khash_ctl_hot_fops = {
+	.owner   = THIS_MODULE,
+	.open    = khash_ctl_hot_open,
+	.read    = seq_read,
+	.write   = khash_ctl_hot_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static void
+khash_ctl_dbg_add(khash_ctl_entry_t *entry)
+{
+	if (!khash_ctl_dbg)
+		return;
+
+	entry->dbg = debugfs_create_dir(entry->name, khash_ctl_dbg);
+	if (IS_ERR_OR_NULL(entry->dbg)) {
+		entry->dbg = NULL;
+		return;
+	}
+
+	debugfs_create_file("mem", 0400, entry->dbg, entry, &khash_ctl_mem_fops);
+	debugfs_create_file("hot", 0600, entry->dbg, entry, &khash_ctl_hot_fops);
+	/* BPF id, KHASH_CTL_MAX_IDS when none is left */
+	debugfs_create_u32("id", 0400, entry->dbg, &entry->id);
+}
+
+int
+khash_ctl_register(const char *name, khash_t *kh, spinlock_t *lock,
+		const khash_ctl_ops_t *ops, void *priv)
+{
+	khash_ctl_entry_t *entry = NULL;
+
+	/* Values are 64 bit handles, not inline data */
+	if (unlikely(!name || !kh || kh->vsize ||
+			strlen(name) >= KHASH_CTL_NAME_LEN))
+		return (-1);
+
+	entry = kzalloc(sizeof(khash_ctl_entry_t), GFP_KERNEL);
+	if (unlikely(!entry))
+		return (-1);
+
+	strscpy(entry->name, name, KHASH_CTL_NAME_LEN);
+	entry->kh = kh;
+	entry->lock = lock;
+	entry->ops = ops;
+	entry->priv = priv;
+
+	down_write(&khash_ctl_rwsem);
+	if (khash_ctl_find(name)) {
+		up_write(&khash_ctl_rwsem);
+		kfree(entry);
+		return (-1);
+	}
+	list_add_tail(&entry->list, &khash_ctl_list);
+	khash_ctl_dbg_add(entry);
+
+	for (entry->id = 0; entry->id < KHASH_CTL_MAX_IDS; entry->id++) {
+		if (!rcu_access_pointer(khash_ctl_ids[entry->id])) {
+			rcu_assign_pointer(khash_ctl_ids[entry->id], entry);
+			break;
+		}
+	}
+	up_write(&khash_ctl_rwsem);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_ctl_register);
+
+/* Waits for the batches in flight on the table */
+int
+khash_ctl_unregister(const char *name)
+{
+	khash_ctl_entry_t *entry = NULL;
+
+	if (unlikely(!name))
+		return (-1);
+
+	down_write(&khash_ctl_rwsem);
+	entry = khash_ctl_find(name);
+	if (entry) {
+		list_del(&entry->list);
+		if (entry->id < KHASH_CTL_MAX_IDS)
+			RCU_INIT_POINTER(khash_ctl_ids[entry->id], NULL);
+	}
+	up_write(&khash_ctl_rwsem);
+
+	if (!entry)
+		return (-1);
+
+	/* BPF programs may still be on it */
+	synchronize_rcu();
+
+	/* Waits for the readers of its files as well */
+	debugfs_remove_recursive(entry->dbg);
+	kfree(entry);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_ctl_unregister);
+
+__always_inline static khash_key_t
+khash_ctl_key(struct khash_ctl_rec *rec, uint32_t flags)
+{
+	khash_key_t hash = khash_hash_u64(rec->key);
+
+	if (flags & KHASH_CTL_F_HASH)
+		hash.key = rec->hash;
+
+	return (hash);
+}
+
+/*
+ * Handles never turn into kernel pointers: no value_new(), no ADD. Nor do
+ * concurrent ioctls race the owner writers: no lock, no ADD nor DEL.
+ */
+__always_inline static int
+khash_ctl_writable(khash_ctl_entry_t *entry)
+{
+	return (entry->lock && entry->ops && entry->ops->value_new);
+}
+
+__always_inline static void *
+khash_ctl_value_new(khash_ctl_entry_t *entry, uint64_t handle, gfp_t flags)
+{
+	if (!khash_ctl_writable(entry))
+		return (NULL);
+
+	return (entry->ops->value_new(entry->priv, handle, flags));
+}
+
+/* Nor do kernel pointers reach userspace: no value_get(), handle 0 */
+__always_inline static uint64_t
+khash_ctl_value_get(khash_ctl_entry_t *entry, void *value)
+{
+	if (!entry->ops || !entry->ops->value_get)
+		return (0);
+
+	return (entry->ops->value_get(entry->priv, value));
+}
+
+__always_inline static void
+khash_ctl_value_free(khash_ctl_entry_t *entry, void *value)
+{
+	if (entry->ops && entry->ops->value_free)
+		entry->ops->value_free(entry->priv, value);
+}
+
+__always_inline static void
+khash_ctl_lock(khash_ctl_entry_t *entry)
+{
+	spin_lock_bh(entry->lock);
+}
+
+__always_inline static void
+khash_ctl_unlock(khash_ctl_entry_t *entry)
+{
+	spin_unlock_bh(entry->lock);
+}
+
+/* Entries and values are built before taking the owner lock */
+static uint32_t
+khash_ctl_add(khash_ctl_entry_t *entry, struct khash_ctl_rec *rec,
+		uint32_t n, uint32_t flags, khash_bulk_t *ent)
+{
+	uint32_t i, m = 0, done;
+	void *value = NULL;
+
+	if (!khash_ctl_writable(entry)) {
+		for (i = 0; i < n; i++)
+			rec[i].status = -EOPNOTSUPP;
+		return (0);
+	}
+
+	for (i = 0; i < n; i++) {
+		rec[i].status = -ENOMEM;
+
+		value = khash_ctl_value_new(entry, rec[i].value, GFP_KERNEL);
+		if (!value)
+			continue;
+
+		memset(&ent[m], 0, sizeof(khash_bulk_t));
+		ent[m].hash = khash_ctl_key(&rec[i], flags);
+		ent[m].value = value;
+		ent[m].tag = i;
+		m++;
+	}
+
+	khash_bulk_prepare(entry->kh, ent, m, GFP_KERNEL);
+	for (i = 0; i < m; i++) {
+		if (ent[i].item)
+			rec[ent[i].tag].status = -EEXIST;
+	}
+
+	khash_ctl_lock(entry);
+	done = khash_add_bulk(entry->kh, ent, m, GFP_ATOMIC);
+	khash_ctl_unlock(entry);
+
+	/* Never published, no grace period needed */
+	for (i = 0; i < m; i++) {
+		if (!ent[i].status)
+			rec[ent[i].tag].status = 0;
+		else
+			khash_ctl_value_free(entry, ent[i].value);
+	}
+
+	return (done);
+}
+
+static uint32_t
+khash_ctl_del(khash_ctl_entry_t *entry, struct khash_ctl_rec *rec,
+		uint32_t n, uint32_t flags, khash_bulk_t *ent)
+{
+	uint32_t i, done;
+
+	if (!entry->lock) {
+		for (i = 0; i < n; i++)
+			rec[i].status = -EOPNOTSUPP;
+		return (0);
+	}
+
+	for (i = 0; i < n; i++) {
+		memset(&ent[i], 0, sizeof(khash_bulk_t));
+		ent[i].hash = khash_ctl_key(&rec[i], flags);
+		ent[i].tag = i;
+	}
+
+	khash_ctl_lock(entry);
+	done = khash_del_bulk(entry->kh, ent, n);
+	khash_ctl_unlock(entry);
+
+	for (i = 0; i < n; i++) {
+		if (ent[i].status) {
+			rec[ent[i].tag].status = -ENOENT;
+			continue;
+		}
+
+		rec[ent[i].tag].status = 0;
+		rec[ent[i].tag].value = khash_ctl_value_get(entry, ent[i].value);
+		khash_ctl_value_free(entry, ent[i].value);
+	}
+
+	return (done);
+}
+
+static uint32_t
+khash_ctl_lookup(khash_ctl_entry_t *entry, struct khash_ctl_rec *rec,
+		uint32_t n, uint32_t flags)
+{
+	uint32_t i, done = 0;
+	void *value = NULL;
+
+	rcu_read_lock();
+	for (i = 0; i < n; i++) {
+		if (khash_lookup(entry->kh, khash_ctl_key(&rec[i], flags),
+				&value) < 0) {
+			rec[i].status = -ENOENT;
+			continue;
+		}
+
+		rec[i].status = 0;
+		rec[i].value = khash_ctl_value_get(entry, value);
+		done++;
+	}
+	rcu_read_unlock();
+
+	return (done);
+}
+
+/* BPF side: rcu_read_lock() taken by the kfunc, BHs off */
+__always_inline static khash_ctl_entry_t *
+khash_ctl_bpf_entry(uint32_t id)
+{
+	if (unlikely(id >= KHASH_CTL_MAX_IDS))
+		return (NULL);
+
+	return (rcu_dereference(khash_ctl_ids[id]));
+}
+
+int
+khash_ctl_bpf_lookup(uint32_t id, uint64_t key, uint32_t hash, uint32_t flags,
+		uint64_t *value)
+{
+	struct khash_ctl_rec rec = { .key = key, .hash = hash };
+	khash_ctl_entry_t *entry = khash_ctl_bpf_entry(id);
+	void *v = NULL;
+
+	if (unlikely(!entry || !value))
+		return (-ENOENT);
+
+	/* Kernel pointers are never handed out */
+	if (!entry->ops || !entry->ops->value_get)
+		return (-EOPNOTSUPP);
+
+	if (khash_lookup(entry->kh, khash_ctl_key(&rec, flags), &v) < 0)
+		return (-ENOENT);
+
+	*value = khash_ctl_value_get(entry, v);
+
+	return (0);
+}
+
+/*
+ * Insert or replace, as BPF_ANY. Writers MUST be serialized: tables
+ * without an owner lock or without value_new() are read only.
+ */
+int
+khash_ctl_bpf_update(uint32_t id, uint64_t key, uint32_t hash, uint32_t flags,
+		uint64_t value)
+{
+	struct khash_ctl_rec rec = { .key = key, .hash = hash };
+	khash_ctl_entry_t *entry = khash_ctl_bpf_entry(id);
+	khash_key_t h = khash_ctl_key(&rec, flags);
+	void *v = NULL, *old = NULL;
+	int ret = 0;
+
+	if (unlikely(!entry))
+		return (-ENOENT);
+
+	if (!khash_ctl_writable(entry))
+		return (-EOPNOTSUPP);
+
+	v = khash_ctl_value_new(entry, value, GFP_ATOMIC);
+	if (!v)
+		return (-ENOMEM);
+
+	khash_ctl_lock(entry);
+	if (!khash_lookup(entry->kh, h, NULL))
+		ret = khash_replace(entry->kh, h, v, &old) < 0 ? -EOPNOTSUPP : 0;
+	else if (khash_addentry(entry->kh, h, v, GFP_ATOMIC) < 0)
+		ret = -ENOMEM;
+	khash_ctl_unlock(entry);
+
+	/* Never published, no grace period needed */
+	if (ret)
+		khash_ctl_value_free(entry, v);
+	else if (old)
+		khash_ctl_value_free(entry, old);
+
+	return (ret);
+}
+
+int
+khash_ctl_bpf_delete(uint32_t id, uint64_t key, uint32_t hash, uint32_t flags)
+{
+	struct khash_ctl_rec rec = { .key = key, .hash = hash };
+	khash_ctl_entry_t *entry = khash_ctl_bpf_entry(id);
+	void *v = NULL;
+	int ret;
+
+	if (unlikely(!entry))
+		return (-ENOENT);
+
+	if (!entry->lock)
+		return (-EOPNOTSUPP);
+
+	khash_ctl_lock(entry);
+	ret = khash_rementry(entry->kh, khash_ctl_key(&rec, flags), &v);
+	khash_ctl_unlock(entry);
+
+	if (ret < 0)
+		return (-ENOENT);
+
+	khash_ctl_value_free(entry, v);
+
+	return (0);
+}
+
+static long
+khash_ctl_batch(unsigned int cmd, struct khash_ctl_batch __user *ubatch)
+{
+	struct khash_ctl_rec __user *urec = NULL;
+	khash_ctl_entry_t *entry = NULL;
+	struct khash_ctl_batch batch;
+	struct khash_ctl_rec *rec = NULL;
+	khash_bulk_t *ent = NULL;
+	uint32_t i, n, done = 0;
+	long ret = 0;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return (-EFAULT);
+
+	batch.name[KHASH_CTL_NAME_LEN - 1] = '\0';
+	urec = u64_to_user_ptr(batch.recs);
+
+	rec = kmalloc_array(KHASH_CTL_CHUNK, sizeof(*rec), GFP_KERNEL);
+	ent = kmalloc_array(KHASH_CTL_CHUNK, sizeof(*ent), GFP_KERNEL);
+	if (!rec || !ent) {
+		ret = -ENOMEM;
+		goto khash_ctl_batch_out;
+	}
+
+	down_read(&khash_ctl_rwsem);
+
+	entry = khash_ctl_find(batch.name);
+	if (!entry) {
+		ret = -ENOENT;
+		goto khash_ctl_batch_unlock;
+	}
+
+	for (i = 0; i < batch.count; i += n) {
+		n = min_t(uint32_t, batch.count - i, KHASH_CTL_CHUNK);
+
+		if (copy_from_user(rec, urec + i, n * sizeof(*rec))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		switch (cmd) {
+		case KHASH_CTL_IOC_ADD:
+			done += khash_ctl_add(entry, rec, n, batch.flags, ent);
+			break;
+		case KHASH_CTL_IOC_DEL:
+			done += khash_ctl_del(entry, rec, n, batch.flags, ent);
+			break;
+		case KHASH_CTL_IOC_LOOKUP:
+		default:
+			done += khash_ctl_lookup(entry, rec, n, batch.flags);
+			break;
+		}
+
+		if (copy_to_user(urec + i, rec, n * sizeof(*rec))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		cond_resched();
+	}
+
+khash_ctl_batch_unlock:
+	up_read(&khash_ctl_rwsem);
+
+	if (!ret && put_user(done, &ubatch->count))
+		ret = -EFAULT;
+
+khash_ctl_batch_out:
+	kfree(ent);
+	kfree(rec);
+	return (ret);
+}
+
+static void
+khash_ctl_snap_release(struct kref *ref)
+{
+	khash_ctl_snap_t *snap = container_of(ref, khash_ctl_snap_t, ref);
+
+	vfree(snap->buf);
+	kfree(snap);
+}
+
+static void
+khash_ctl_snap_put(khash_ctl_snap_t *snap)
+{
+	if (snap)
+		kref_put(&snap->ref, khash_ctl_snap_release);
+}
+
+static int
+khash_ctl_snap_rec(khash_key_t hash, void *value, void *user_data)
+{
+	khash_ctl_snap_iter_t *iter = (khash_ctl_snap_iter_t *)user_data;
+	struct khash_snap_rec *rec = NULL;
+
+	if (iter->n == iter->cap)
+		return (1);
+
+	rec = &iter->rec[iter->n++];
+	rec->key = hash.__key._64;
+	rec->hash = hash.key;
+	rec->value = khash_ctl_value_get(iter->entry, value);
+
+	return (0);
+}
+
+/*
+ * The table is walked in RCU chunks without stopping its writers: the
+ * buffer leaves room for some growth, and the generation taken before and
+ * after the walk tells userspace whether the result is exact.
+ */
+static khash_ctl_snap_t *
+khash_ctl_snap_build(khash_ctl_entry_t *entry)
+{
+	khash_ctl_snap_iter_t iter = { .entry = entry };
+	struct khash_snap_hdr *hdr = NULL;
+	khash_ctl_snap_t *snap = NULL;
+	khash_cursor_t cursor;
+
+	snap = kzalloc(sizeof(khash_ctl_snap_t), GFP_KERNEL);
+	if (unlikely(!snap))
+		return (NULL);
+
+	kref_init(&snap->ref);
+
+	iter.cap = khash_size(entry->kh);
+	iter.cap += iter.cap / 8 + 64;
+	snap->size = PAGE_ALIGN(sizeof(struct khash_snap_hdr) +
+			(uint64_t)iter.cap * sizeof(struct khash_snap_rec));
+
+	snap->buf = vmalloc_user(snap->size);
+	if (unlikely(!snap->buf)) {
+		kfree(snap);
+		return (NULL);
+	}
+
+	hdr = (struct khash_snap_hdr *)snap->buf;
+	iter.rec = (struct khash_snap_rec *)(hdr + 1);
+
+	hdr->magic = KHASH_SNAP_MAGIC;
+	hdr->version = KHASH_SNAP_VERSION;
+	hdr->hdr_size = sizeof(struct khash_snap_hdr);
+	hdr->rec_size = sizeof(struct khash_snap_rec);
+	hdr->gen = khash_gen_get(entry->kh);
+
+	khash_cursor_init(&cursor);
+	while (!cursor.done) {
+		rcu_read_lock();
+		khash_cursor_next(entry->kh, &cursor, khash_ctl_snap_rec, &iter,
+				KHASH_CTL_CHUNK);
+		rcu_read_unlock();
+
+		cond_resched();
+	}
+
+	hdr->gen_end = khash_gen_get(entry->kh);
+	hdr->count = iter.n;
+	if (iter.n == iter.cap)
+		hdr->flags |= KHASH_SNAP_F_TRUNCATED;
+
+	return (snap);
+}
+
+static long
+khash_ctl_snapshot(khash_ctl_file_t *kf, unsigned int cmd,
+		struct khash_ctl_snap __user *usnap)
+{
+	khash_ctl_snap_t *snap = NULL;
+	khash_ctl_entry_t *entry = NULL;
+	struct khash_ctl_snap req;
+	long ret = 0;
+
+	if (copy_from_user(&req, usnap, sizeof(req)))
+		return (-EFAULT);
+
+	req.name[KHASH_CTL_NAME_LEN - 1] = '\0';
+
+	down_read(&khash_ctl_rwsem);
+
+	entry = khash_ctl_find(req.name);
+	if (!entry) {
+		up_read(&khash_ctl_rwsem);
+		return (-ENOENT);
+	}
+
+	if (cmd == KHASH_CTL_IOC_GEN) {
+		req.gen = khash_gen_get(entry->kh);
+		req.count = khash_size(entry->kh);
+		req.size = 0;
+		up_read(&khash_ctl_rwsem);
+		goto khash_ctl_snapshot_out;
+	}
+
+	snap = khash_ctl_snap_build(entry);
+	up_read(&khash_ctl_rwsem);
+
+	if (!snap)
+		return (-ENOMEM);
+
+	req.gen = ((struct khash_snap_hdr *)snap->buf)->gen_end;
+	req.count = ((struct khash_snap_hdr *)snap->buf)->count;
+	req.size = snap->size;
+
+	/* Mappings of the previous snapshot keep their own reference */
+	mutex_lock(&kf->lock);
+	swap(kf->snap, snap);
+	mutex_unlock(&kf->lock);
+	khash_ctl_snap_put(snap);
+
+khash_ctl_snapshot_out:
+	if (copy_to_user(usnap, &req, sizeof(req)))
+		ret = -EFAULT;
+
+	return (ret);
+}
+
+static long
+khash_ctl_id(struct khash_ctl_id __user *uid)
+{
+	khash_ctl_entry_t *entry = NULL;
+	struct khash_ctl_id req;
+	long ret = 0;
+
+	if (copy_from_user(&req, uid, sizeof(req)))
+		return (-EFAULT);
+
+	req.name[KHASH_CTL_NAME_LEN - 1] = '\0';
+
+	down_read(&khash_ctl_rwsem);
+	entry = khash_ctl_find(req.name);
+	if (!entry)
+		ret = -ENOENT;
+	else if (entry->id >= KHASH_CTL_MAX_IDS)
+		ret = -ENOSPC;
+	else
+		req.id = entry->id;
+	up_read(&khash_ctl_rwsem);
+
+	if (!ret && copy_to_user(uid, &req, sizeof(req)))
+		ret = -EFAULT;
+
+	return (ret);
+}
+
+static void
+khash_ctl_vma_open(struct vm_area_struct *vma)
+{
+	khash_ctl_snap_t *snap = vma->vm_private_data;
+
+	kref_get(&snap->ref);
+}
+
+static void
+khash_ctl_vma_close(struct vm_area_struct *vma)
+{
+	khash_ctl_snap_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct khash_ctl_vm_ops = {
+	.open  = khash_ctl_vma_open,
+	.close = khash_ctl_vma_close,
+};
+
+static int
+khash_ctl_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	khash_ctl_file_t *kf = file->private_data;
+	khash_ctl_snap_t *snap = NULL;
+	int ret;
+
+	if (vma->vm_flags & VM_WRITE)
+		return (-EPERM);
+
+	mutex_lock(&kf->lock);
+	snap = kf->snap;
+	if (!snap) {
+		mutex_unlock(&kf->lock);
+		return (-ENODEV);
+	}
+
+	ret = remap_vmalloc_range(vma, snap->buf, vma->vm_pgoff);
+	if (!ret) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+		vm_flags_clear(vma, VM_MAYWRITE);
+#else
+		vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+		kref_get(&snap->ref);
+		vma->vm_private_data = snap;
+		vma->vm_ops = &khash_ctl_vm_ops;
+	}
+	mutex_unlock(&kf->lock);
+
+	return (ret);
+}
+
+static int
+khash_ctl_open(struct inode *inode, struct file *file)
+{
+	khash_ctl_file_t *kf = NULL;
+
+	kf = kzalloc(sizeof(khash_ctl_file_t), GFP_KERNEL);
+	if (unlikely(!kf))
+		return (-ENOMEM);
+
+	mutex_init(&kf->lock);
+	file->private_data = kf;
+
+	return (0);
+}
+
+static int
+khash_ctl_release(struct inode *inode, struct file *file)
+{
+	khash_ctl_file_t *kf = file->private_data;
+
+	khash_ctl_snap_put(kf->snap);
+	kfree(kf);
+
+	return (0);
+}
+
+static long
+khash_ctl_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	if ((cmd == KHASH_CTL_IOC_ADD || cmd == KHASH_CTL_IOC_DEL) &&
+			!capable(CAP_NET_ADMIN))
+		return (-EPERM);
+
+	switch (cmd) {
+	case KHASH_CTL_IOC_ADD:
+	case KHASH_CTL_IOC_DEL:
+	case KHASH_CTL_IOC_LOOKUP:
+		return (khash_ctl_batch(cmd, (struct khash_ctl_batch __user *)arg));
+	case KHASH_CTL_IOC_ID:
+		return (khash_ctl_id((struct khash_ctl_id __user *)arg));
+	case KHASH_CTL_IOC_SNAPSHOT:
+	case KHASH_CTL_IOC_GEN:
+		return (khash_ctl_snapshot(file->private_data, cmd,
+				(struct khash_ctl_snap __user *)arg));
+	default:
+		return (-ENOTTY);
+	}
+}
+
+static const struct file_operations khash_ctl_fops = {
+	.owner          = THIS_MODULE,
+	.open           = khash_ctl_open,
+	.release        = khash_ctl_release,
+	.mmap           = khash_ctl_mmap,
+	.unlocked_ioctl = khash_ctl_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0)
+	.compat_ioctl   = compat_ptr_ioctl,
+#endif
+	.llseek         = noop_llseek,
+};
+
+static struct miscdevice khash_ctl_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name  = KHASH_CTL_DEV,
+	.fops  = &khash_ctl_fops,
+	.mode  = 0600,
+};
+
+int
+khash_ctl_init(void)
+{
+	int ret;
+
+	/* Monitoring only: the control device works without it */
+	khash_ctl_dbg = debugfs_create_dir(KHASH_CTL_DEV, NULL);
+	if (IS_ERR(khash_ctl_dbg))
+		khash_ctl_dbg = NULL;
+
+	ret = misc_register(&khash_ctl_dev);
+	if (ret)
+		debugfs_remove_recursive(khash_ctl_dbg);
+
+	return (ret);
+}
+
+void
+khash_ctl_exit(void)
+{
+	misc_deregister(&khash_ctl_dev);
+	debugfs_remove_recursive(khash_ctl_dbg);
+}
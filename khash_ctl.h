@@ -0,0 +1,136 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KHASH_CTL_H
+#define KHASH_CTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Control interface of named tables: /dev/khash
+ * Shared with userspace, keep it free of kernel only types.
+ */
+
+#define KHASH_CTL_DEV      "khash"
+#define KHASH_CTL_NAME_LEN 32
+
+struct khash_ctl_rec {
+	__u64 key;    /* Raw key, khash_key_t.__key._64 */
+	__u32 hash;   /* khash_key_t.key, used with KHASH_CTL_F_HASH */
+	__s32 status; /* Out: 0 or -errno */
+	__u64 value;  /* In: value handle (ADD), out: value handle */
+};
+
+/* khash_ctl_batch flags */
+#define KHASH_CTL_F_HASH 0x0001 /* Use rec.hash instead of hashing rec.key */
+
+struct khash_ctl_batch {
+	char name[KHASH_CTL_NAME_LEN];
+	__u32 count;  /* In: records, out: records succeeded */
+	__u32 flags;
+	__u64 recs;   /* Pointer to struct khash_ctl_rec[count] */
+};
+
+/*
+ * Snapshot: KHASH_CTL_IOC_SNAPSHOT serializes a table in a buffer bound to
+ * the file descriptor, which can then be mmap()ed read only (offset 0,
+ * khash_ctl_snap.size bytes): a khash_snap_hdr followed by count records.
+ * The snapshot is exact when gen == gen_end; it is stale as soon as the
+ * table generation returned by KHASH_CTL_IOC_GEN differs from gen_end.
+ */
+#define KHASH_SNAP_MAGIC   0x4b48534e /* "KHSN" */
+#define KHASH_SNAP_VERSION 1
+
+/* khash_snap_hdr flags */
+#define KHASH_SNAP_F_TRUNCATED 0x0001 /* Table grew beyond the buffer */
+
+struct khash_snap_hdr {
+	__u32 magic;
+	__u32 version;
+	__u32 hdr_size;
+	__u32 rec_size;
+	__u32 count;   /* Records following the header */
+	__u32 flags;
+	__u32 gen;     /* Table generation when the walk started */
+	__u32 gen_end; /* Table generation when the walk ended */
+};
+
+struct khash_snap_rec {
+	__u64 key;
+	__u32 hash;
+	__u32 pad;
+	__u64 value;  /* Value handle, as returned by KHASH_CTL_IOC_LOOKUP */
+};
+
+struct khash_ctl_snap {
+	char name[KHASH_CTL_NAME_LEN];
+	__u32 gen;    /* Out: current table generation */
+	__u32 count;  /* Out: entries (in the snapshot, or in the table) */
+	__u64 size;   /* Out: bytes to mmap() */
+};
+
+/* Id naming a table to the BPF kfuncs, see khash_bpf.h */
+#define KHASH_CTL_MAX_IDS 64
+
+struct khash_ctl_id {
+	char name[KHASH_CTL_NAME_LEN];
+	__u32 id;     /* Out */
+	__u32 pad;
+};
+
+#define KHASH_CTL_IOC_MAGIC    'K'
+#define KHASH_CTL_IOC_ADD      _IOWR(KHASH_CTL_IOC_MAGIC, 1, struct khash_ctl_batch)
+#define KHASH_CTL_IOC_DEL      _IOWR(KHASH_CTL_IOC_MAGIC, 2, struct khash_ctl_batch)
+#define KHASH_CTL_IOC_LOOKUP   _IOWR(KHASH_CTL_IOC_MAGIC, 3, struct khash_ctl_batch)
+#define KHASH_CTL_IOC_SNAPSHOT _IOWR(KHASH_CTL_IOC_MAGIC, 4, struct khash_ctl_snap)
+#define KHASH_CTL_IOC_GEN      _IOWR(KHASH_CTL_IOC_MAGIC, 5, struct khash_ctl_snap)
+#define KHASH_CTL_IOC_ID       _IOWR(KHASH_CTL_IOC_MAGIC, 6, struct khash_ctl_id)
+
+#ifdef __KERNEL__
+
+/*
+ * Translate the 64 bit handles seen by userspace into table values. Kernel
+ * pointers never cross the interface: without value_new() ADD fails with
+ * -EOPNOTSUPP, without value_get() every handle reads 0 (key only tables
+ * still serve DEL, LOOKUP and snapshots). value_free() is invoked right
+ * after a value has been removed by the control path: readers may still
+ * see it, the actual release has to be deferred past a grace period.
+ */
+typedef struct {
+	void *(*value_new)(void *priv, uint64_t handle, gfp_t flags);
+	uint64_t (*value_get)(void *priv, void *value);
+	void (*value_free)(void *priv, void *value);
+} khash_ctl_ops_t;
+
+/*
+ * @lock serializes the owner writers, it is taken with spin_lock_bh().
+ * Without it the table is read-only: ADD and DEL, from userspace or BPF,
+ * fail with -EOPNOTSUPP.
+ */
+int khash_ctl_register(const char *name, khash_t *kh, spinlock_t *lock,
+		const khash_ctl_ops_t *ops, void *priv);
+int khash_ctl_unregister(const char *name);
+
+#endif
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+
+#include "khash.h"
+#include "khash_internal.h"
+
+#define KHASH_FILTER_MIN_CTR    64
+#define KHASH_FILTER_MAX_SHIFT  16
+
+void
+khash_filter_free(khash_filter_t *f)
+{
+	if (!f)
+		return;
+
+	kvfree(f->ctr);
+	free_percpu(f->stats);
+	kfree(f);
+}
+
+static void
+khash_filter_free_rcu(struct rcu_head *rcu)
+{
+	khash_filter_free(container_of(rcu, khash_filter_t, rcu));
+}
+
+static khash_filter_t *
+khash_filter_new(uint32_t capacity, uint32_t fp_shift)
+{
+	khash_filter_t *f = NULL;
+	uint64_t nctr;
+
+	nctr = (uint64_t)capacity * fp_shift * 3 / 2;
+	if (nctr < KHASH_FILTER_MIN_CTR)
+		nctr = KHASH_FILTER_MIN_CTR;
+	if (nctr > (1ULL << 31))
+		nctr = 1ULL << 31;
+
+	f = kzalloc(sizeof(khash_filter_t), GFP_KERNEL);
+	if (unlikely(!f))
+		return (NULL);
+
+	f->mask = roundup_pow_of_two(nctr) - 1;
+	f->nhash = fp_shift;
+
+	f->ctr = kvzalloc((size_t)f->mask + 1, GFP_KERNEL);
+	if (unlikely(!f->ctr))
+		goto khash_filter_new_fail;
+
+	f->stats = alloc_percpu(khash_filter_pcpu_t);
+	if (unlikely(!f->stats))
+		goto khash_filter_new_fail;
+
+	return (f);
+
+khash_filter_new_fail:
+	khash_filter_free(f);
+	return (NULL);
+}
+
+int
+khash_filter_enable(khash_t *khash, uint32_t capacity, uint32_t fp_shift)
+{
+	khash_filter_t *f = NULL, *old = NULL;
+	khash_item_t *item = NULL;
+	uint32_t i;
+
+	if (unlikely(!khash || !fp_shift || fp_shift > KHASH_FILTER_MAX_SHIFT))
+		return (-1);
+
+	might_sleep();
+
+	if (!capacity)
+		capacity = max_t(uint32_t, khash->count, khash->bck_size);
+
+	f = khash_filter_new(capacity, fp_shift);
+	if (unlikely(!f))
+		return (-1);
+
+	/* Writers are serialized: no entry can come or go during the walk */
+	for (i = 0; i < khash->bck_size; i++) {
+		KHASH_CHAIN_FOR_EACH(item, khash_bck_get(khash, i))
+			khash_filter_add(f, item->hash);
+	}
+
+	old = khash_filter_get(khash);
+	rcu_assign_pointer(khash->filter, f);
+	if (old)
+		call_rcu(&old->rcu, khash_filter_free_rcu);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_filter_enable);
+
+void
+khash_filter_disable(khash_t *khash)
+{
+	khash_filter_t *f = NULL;
+
+	if (unlikely(!khash))
+		return;
+
+	f = khash_filter_get(khash);
+	if (!f)
+		return;
+
+	RCU_INIT_POINTER(khash->filter, NULL);
+	call_rcu(&f->rcu, khash_filter_free_rcu);
+}
+EXPORT_SYMBOL(khash_filter_disable);
+
+/* All the entries are gone with khash_flush() */
+void
+khash_filter_reset(khash_t *kh)
+{
+	khash_filter_t *f = khash_filter_get(kh);
+
+	if (f)
+		memset(f->ctr, 0, (size_t)f->mask + 1);
+}
+
+int
+khash_filter_stats_get(khash_t *khash, khash_filter_stats_t *stats)
+{
+	khash_filter_pcpu_t *pcpu = NULL;
+	khash_filter_t *f = NULL;
+	int cpu;
+
+	if (unlikely(!khash || !stats))
+		return (-1);
+
+	memset(stats, 0, sizeof(khash_filter_stats_t));
+
+	rcu_read_lock();
+	f = rcu_dereference(khash->filter);
+	if (!f) {
+		rcu_read_unlock();
+		return (-1);
+	}
+
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(f->stats, cpu);
+		stats->checks += pcpu->checks;
+		stats->skips += pcpu->skips;
+	}
+
+	stats->counters = f->mask + 1;
+	stats->hashes = f->nhash;
+	rcu_read_unlock();
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_filter_stats_get);
@@ -0,0 +1,47 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KHASH_FILTER_H
+#define KHASH_FILTER_H
+
+/*
+ * Optional counting Bloom filter consulted by every lookup before the
+ * bucket array: most misses are then answered without walking a chain.
+ * It is sized for @capacity entries at a false positive rate of about
+ * 2^-@fp_shift, costing roughly 1.5 * @fp_shift bytes per entry.
+ *
+ * Enabling (or resizing) rebuilds it from the current entries: table
+ * writers MUST be serialized with it and it requires non atomic context.
+ */
+
+typedef struct {
+	uint64_t checks;   /* Lookups which consulted the filter */
+	uint64_t skips;    /* Misses answered by the filter alone */
+	uint32_t counters;
+	uint32_t hashes;
+} khash_filter_stats_t;
+
+int khash_filter_enable(khash_t *khash, uint32_t capacity, uint32_t fp_shift);
+void khash_filter_disable(khash_t *khash);
+int khash_filter_stats_get(khash_t *khash, khash_filter_stats_t *stats);
+
+#endif
@@ -0,0 +1,262 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+#include <linux/timex.h>
+#include <linux/bitops.h>
+#include <linux/crc32c.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+#include <linux/xxhash.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+
+#include "khash.h"
+#include "khash_internal.h"
+
+static unsigned int hash_bench;
+module_param(hash_bench, uint, 0444);
+MODULE_PARM_DESC(hash_bench, "Keys hashed by the built-in hash ops benchmark at load (0: off)");
+
+static unsigned int hash_bench_klen = 16;
+module_param(hash_bench_klen, uint, 0444);
+MODULE_PARM_DESC(hash_bench_klen, "Key length of the hash ops benchmark");
+
+static uint32_t
+khash_hashfn_jhash(const void *key, uint32_t len, uint32_t seed)
+{
+	return (jhash(key, len, seed));
+}
+
+static uint32_t
+khash_hashfn_crc32c(const void *key, uint32_t len, uint32_t seed)
+{
+	return (crc32c(seed, key, len));
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+static uint32_t
+khash_hashfn_xxh32(const void *key, uint32_t len, uint32_t seed)
+{
+	return (xxh32(key, len, seed));
+}
+#else
+#define khash_hashfn_xxh32 khash_hashfn_jhash
+#endif
+
+const khash_hash_ops_t khash_hash_ops_jhash = {
+	.name = "jhash",
+	.hash = khash_hashfn_jhash,
+};
+EXPORT_SYMBOL(khash_hash_ops_jhash);
+
+const khash_hash_ops_t khash_hash_ops_crc32c = {
+	.name = "crc32c",
+	.hash = khash_hashfn_crc32c,
+};
+EXPORT_SYMBOL(khash_hash_ops_crc32c);
+
+const khash_hash_ops_t khash_hash_ops_xxh32 = {
+	.name = "xxh32",
+	.hash = khash_hashfn_xxh32,
+};
+EXPORT_SYMBOL(khash_hash_ops_xxh32);
+
+static const khash_hash_ops_t *khash_hash_builtin[] = {
+	&khash_hash_ops_jhash,
+	&khash_hash_ops_crc32c,
+	&khash_hash_ops_xxh32,
+};
+
+int
+khash_hash_ops_set(khash_t *khash, const khash_hash_ops_t *ops, uint32_t seed)
+{
+	if (unlikely(!khash || !ops || !ops->hash))
+		return (-1);
+
+	/* Entries already linked would be hashed differently */
+	if (khash->count)
+		return (-1);
+
+	khash->hops = ops;
+	khash->hseed = seed;
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_hash_ops_set);
+
+const khash_hash_ops_t *
+khash_hash_ops_get(khash_t *khash)
+{
+	if (unlikely(!khash))
+		return (NULL);
+
+	return (khash->hops ? khash->hops : &khash_hash_ops_jhash);
+}
+EXPORT_SYMBOL(khash_hash_ops_get);
+
+/* Cheap 64 bit fingerprint of the key bytes, the second half of a match */
+__always_inline static uint64_t
+khash_hash_fold(const uint8_t *key, uint32_t len)
+{
+	uint64_t fold = 0, tail = 0;
+
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+		fold = rol64(fold, 13) ^ get_unaligned((const uint64_t *)key);
+		key += sizeof(uint64_t);
+	}
+
+	if (len) {
+		memcpy(&tail, key, len);
+		fold = rol64(fold, 13) ^ tail;
+	}
+
+	return (fold);
+}
+
+khash_key_t
+khash_hash_key(khash_t *khash, const void *key, uint32_t len)
+{
+	const khash_hash_ops_t *ops = &khash_hash_ops_jhash;
+	khash_key_t hash = {};
+	uint32_t seed = JHASH_INITVAL;
+
+	if (unlikely(!key))
+		return (hash);
+
+	if (khash && khash->hops) {
+		ops = khash->hops;
+		seed = khash->hseed;
+	}
+
+	hash.key = ops->hash(key, len, seed);
+	hash.__key._64 = khash_hash_fold(key, len);
+
+	return (hash);
+}
+EXPORT_SYMBOL(khash_hash_key);
+
+int
+khash_hash_key_match(const void *a, uint32_t alen, const void *b,
+		uint32_t blen)
+{
+	if (unlikely(!a || !b))
+		return (0);
+
+	return (alen == blen && !memcmp(a, b, alen));
+}
+EXPORT_SYMBOL(khash_hash_key_match);
+
+/*
+ * Hash @nkeys keys of @key_len bytes differing only in their first 32
+ * bits (as flows differing in a port do) and spread them over 2^@bck_bits
+ * buckets the way a table does.
+ */
+int
+khash_hash_bench(const khash_hash_ops_t *ops, uint32_t nkeys,
+		uint32_t key_len, uint32_t bck_bits, khash_hash_bench_t *res)
+{
+	uint32_t *hashes = NULL, *count = NULL;
+	uint64_t sq = 0, nbck;
+	uint8_t *keys = NULL;
+	cycles_t start;
+	uint32_t i;
+	int ret = -1;
+
+	if (unlikely(!ops || !ops->hash || !nkeys || !res ||
+			key_len < sizeof(uint32_t) || !bck_bits || bck_bits > 24))
+		return (-1);
+
+	might_sleep();
+
+	memset(res, 0, sizeof(khash_hash_bench_t));
+	nbck = 1ULL << bck_bits;
+
+	keys = vmalloc((size_t)nkeys * key_len);
+	hashes = vmalloc((size_t)nkeys * sizeof(uint32_t));
+	count = vzalloc(nbck * sizeof(uint32_t));
+	if (!keys || !hashes || !count)
+		goto khash_hash_bench_out;
+
+	get_random_bytes(keys, key_len);
+	for (i = 0; i < nkeys; i++) {
+		memcpy(keys + (size_t)i * key_len, keys, key_len);
+		put_unaligned(i, (uint32_t *)(keys + (size_t)i * key_len));
+	}
+
+	start = get_cycles();
+	for (i = 0; i < nkeys; i++)
+		hashes[i] = ops->hash(keys + (size_t)i * key_len, key_len,
+				JHASH_INITVAL);
+	res->cycles = div64_u64((uint64_t)(get_cycles() - start) * 100, nkeys);
+
+	for (i = 0; i < nkeys; i++)
+		count[hash_32(hashes[i], bck_bits)]++;
+
+	for (i = 0; i < nbck; i++) {
+		if (!count[i])
+			res->empty++;
+		if (count[i] > res->max)
+			res->max = count[i];
+		sq += (uint64_t)count[i] * count[i];
+	}
+
+	/* chi2 / nbck = sum(count^2) / nkeys - nkeys / nbck */
+	res->chi2 = div64_u64(sq * 1000, nkeys) -
+			div64_u64((uint64_t)nkeys * 1000, nbck);
+	ret = 0;
+
+khash_hash_bench_out:
+	vfree(count);
+	vfree(hashes);
+	vfree(keys);
+	return (ret);
+}
+EXPORT_SYMBOL(khash_hash_bench);
+
+void
+khash_hash_bench_run(void)
+{
+	khash_hash_bench_t res;
+	uint32_t i;
+
+	if (!hash_bench)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(khash_hash_builtin); i++) {
+		if (khash_hash_bench(khash_hash_builtin[i], hash_bench,
+				hash_bench_klen, 19, &res) < 0)
+			continue;
+
+		printk(KERN_INFO "[%s] hash %s: %llu.%02llu cycles/key, chi2 %llu, "
+				"max chain %u, empty %u\n", KHASH_VERSION_STR,
+				khash_hash_builtin[i]->name, res.cycles / 100,
+				res.cycles % 100, res.chi2, res.max, res.empty);
+	}
+}
@@ -0,0 +1,68 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KHASH_HASH_H
+#define KHASH_HASH_H
+
+/*
+ * Per-table hashing of variable length keys. khash_hash_key() hashes
+ * @key with the table ops into khash_key_t.key (which selects the bucket)
+ * and folds its bytes into khash_key_t.__key, that has to match as well.
+ * The ops can only be changed while the table is empty; jhash is the
+ * default. Custom ops are not copied and MUST outlive the table.
+ *
+ * The result is a 96 bit digest of the key, not the key: the fold is not
+ * collision resistant and colliding keys can be crafted, so values MUST
+ * carry their key and lookups MUST check it with khash_hash_key_match()
+ * before trusting a hit.
+ */
+
+typedef uint32_t (*khash_hashfn_t)(const void *key, uint32_t len, uint32_t seed);
+
+typedef struct {
+	const char     *name;
+	khash_hashfn_t hash;
+} khash_hash_ops_t;
+
+extern const khash_hash_ops_t khash_hash_ops_jhash;
+extern const khash_hash_ops_t khash_hash_ops_crc32c; /* SSE4.2/ARMv8 if any */
+extern const khash_hash_ops_t khash_hash_ops_xxh32;
+
+int khash_hash_ops_set(khash_t *khash, const khash_hash_ops_t *ops,
+		uint32_t seed);
+const khash_hash_ops_t *khash_hash_ops_get(khash_t *khash);
+khash_key_t khash_hash_key(khash_t *khash, const void *key, uint32_t len);
+int khash_hash_key_match(const void *a, uint32_t alen, const void *b,
+		uint32_t blen);
+
+typedef struct {
+	uint64_t cycles;   /* Per key, x 100 */
+	uint64_t chi2;     /* Bucket spread, x 1000 of the uniform expectation */
+	uint32_t max;      /* Longest chain */
+	uint32_t empty;    /* Empty buckets */
+} khash_hash_bench_t;
+
+/* Requires non atomic context */
+int khash_hash_bench(const khash_hash_ops_t *ops, uint32_t nkeys,
+		uint32_t key_len, uint32_t bck_bits, khash_hash_bench_t *res);
+
+#endif
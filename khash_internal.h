@@ -30,12 +30,14 @@
 #endif
 
 #include <linux/jhash.h>
+#include <linux/seqlock.h>
+#include <linux/cpumask.h>
+#include <linux/llist.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/percpu-refcount.h>
 
-#define DEFINE_KHASH_STRUCT(__bucket_size__)         \
-		uint32_t          count;                     \
-		uint8_t           ht_is_static;              \
-		uint8_t           ht_static_idx;             \
-		uint32_t          bck_size;                  \
+#define DEFINE_KHASH_BCK_STRUCT(__bucket_size__)     \
 		uint32_t          ht_count[__bucket_size__]; \
 		struct hlist_head ht[__bucket_size__];
 
@@ -44,18 +46,441 @@
 #define KHASH_BCK_SIZE_1k    (1 << 10)
 #define KHASH_BCK_SIZE_512k  (1 << 19)
 
-struct khash_t {
-	DEFINE_KHASH_STRUCT(KHASH_BCK_SIZE_16)
-};
+/*
+ * Bucket arrays live in their own allocation so that they can be backed
+ * by huge pages; ht_count[] MUST stay the first member of every variant.
+ */
+typedef struct {
+	DEFINE_KHASH_BCK_STRUCT(KHASH_BCK_SIZE_16)
+} khash_bck_16_t;
+
+typedef struct {
+	DEFINE_KHASH_BCK_STRUCT(KHASH_BCK_SIZE_1k)
+} khash_bck_1k_t;
+
+typedef struct {
+	DEFINE_KHASH_BCK_STRUCT(KHASH_BCK_SIZE_512k)
+} khash_bck_512k_t;
+
+/*
+ * KHASH_F_SPARSE: bck is a directory of bck_size / KHASH_PAGE_BCK_SIZE
+ * pointers to bucket pages, allocated when the first entry hashes into
+ * them and released (after a grace period) when they empty again.
+ */
+#define KHASH_PAGE_BCK_SHIFT 8
+#define KHASH_PAGE_BCK_SIZE  (1 << KHASH_PAGE_BCK_SHIFT)
+#define KHASH_PAGE_BCK_MASK  (KHASH_PAGE_BCK_SIZE - 1)
+
+typedef struct {
+	struct rcu_head   rcu;
+	uint32_t          count;
+	DEFINE_KHASH_BCK_STRUCT(KHASH_PAGE_BCK_SIZE)
+} khash_bck_page_t;
+
+/*
+ * KHASH_ITEM_F_INLINE entry: the khash_item_t fields up to idx, then the
+ * value right after the key so that small values share its cache line.
+ * value points to data[]; the rcu_head follows data[], idx is its offset.
+ */
+typedef struct {
+	struct hlist_node hh;
+	khash_key_t       hash;
+	void             *value;
+	uint16_t          flags;
+	uint16_t          idx;
+	seqcount_t        seq;
+	u8                data[];
+} khash_iitem_t;
+
+typedef struct {
+	struct rcu_head   rcu;
+	khash_iitem_t    *iitem;
+} khash_iitem_tail_t;
+
+#define KHASH_IITEM_TAIL(vsize) \
+	ALIGN(offsetof(khash_iitem_t, data) + (vsize), sizeof(void *))
+#define KHASH_IITEM_SIZE(vsize) \
+	(KHASH_IITEM_TAIL(vsize) + sizeof(khash_iitem_tail_t))
+
+__always_inline static khash_iitem_t *
+khash_iitem_get(khash_item_t *item)
+{
+	return ((khash_iitem_t *)item);
+}
+
+__always_inline static khash_iitem_tail_t *
+khash_iitem_tail(khash_item_t *item)
+{
+	return ((khash_iitem_tail_t *)((u8 *)item + item->idx));
+}
+
+/* Entries of all kinds are chained for reclaim through this rcu_head */
+__always_inline static struct rcu_head *
+khash_item_rcu(khash_item_t *item)
+{
+	if (unlikely(item->flags & KHASH_ITEM_F_INLINE))
+		return (&khash_iitem_tail(item)->rcu);
 
-typedef struct khash_t khash_16_t;
+	return (&item->rcu);
+}
+
+/*
+ * Counting Bloom filter in front of the buckets: khash_filter_test() == 0
+ * is a guaranteed miss. 8 bit counters saturate and then stick, so that
+ * deletions can never turn a present key into a false negative.
+ */
+#define KHASH_FILTER_CTR_MAX 0xff
+
+typedef struct {
+	uint64_t checks;
+	uint64_t skips;
+} khash_filter_pcpu_t;
+
+typedef struct {
+	struct rcu_head             rcu;
+	uint32_t                    mask;
+	uint32_t                    nhash;
+	khash_filter_pcpu_t __percpu *stats;
+	uint8_t                     *ctr;
+} khash_filter_t;
+
+/*
+ * Per-CPU direct mapped cache of lookup hits. A slot is trusted only
+ * while the shared generation of its index is unchanged: every unlink
+ * bumps it after the entry is gone, so a stale slot can never be used.
+ * Slot updates are guarded by an odd/even seq against nested contexts
+ * on the same CPU.
+ */
+#define KHASH_CACHE_MAX_SLOTS 1024
+
+typedef struct {
+	uint32_t     seq;
+	uint32_t     gen;
+	khash_item_t *item;
+} khash_cache_slot_t;
 
 typedef struct {
-	DEFINE_KHASH_STRUCT(KHASH_BCK_SIZE_1k)
-} khash_1k_t;
+	uint64_t hits;
+	uint64_t misses;
+} khash_cache_pcpu_t;
+
+typedef struct {
+	struct rcu_head             rcu;
+	uint32_t                    mask;
+	uint32_t                    *gen;
+	khash_cache_slot_t __percpu *slot;
+	khash_cache_pcpu_t __percpu *stats;
+} khash_cache_t;
+
+/*
+ * Per-CPU space-saving top-K lists fed by sampled lookups. A nested
+ * context finding the lists busy on its CPU drops its sample.
+ */
+typedef struct {
+	uint32_t           tick;
+	uint32_t           busy;
+	uint32_t           nkey;
+	uint32_t           nbck;
+	khash_sketch_ent_t key[KHASH_SKETCH_TOPK];
+	khash_sketch_ent_t bck[KHASH_SKETCH_TOPK];
+} khash_sketch_pcpu_t;
+
+typedef struct {
+	struct rcu_head              rcu;
+	uint32_t                     mask;
+	uint32_t                     shift;
+	khash_sketch_pcpu_t __percpu *pcpu;
+} khash_sketch_t;
+
+/*
+ * Arena chunks are naturally aligned, so that the chunk (and the arena)
+ * of any slot is found by masking its address. Slots released past their
+ * grace period are pushed lockless on freed; the writers own free and
+ * the carving of the head chunk.
+ */
+#define KHASH_ARENA_ORDER      4
+#define KHASH_ARENA_CHUNK_SIZE (PAGE_SIZE << KHASH_ARENA_ORDER)
+#define KHASH_ARENA_SLOT_SIZE  ALIGN(sizeof(khash_item_t), sizeof(void *))
+
+typedef struct khash_arena_t khash_arena_t;
+
+typedef struct khash_arena_chunk_t {
+	struct khash_arena_chunk_t *next;
+	khash_arena_t              *arena;
+	uint32_t                   used;  /* Slots carved */
+	uint32_t                   nfree; /* Scratch of khash_arena_shrink() */
+} khash_arena_chunk_t;
+
+struct khash_arena_t {
+	atomic_long_t       ref;     /* Live slots, plus one held by the table */
+	struct llist_head   freed;
+	struct llist_node   *free;
+	khash_arena_chunk_t *chunks; /* Head is the one being carved */
+	uint32_t            nchunks;
+	uint64_t            slots;
+	uint64_t            moved;
+};
+
+/*
+ * Item pool: slots carved from naturally aligned chunks (the pool of a
+ * slot is found by masking its address), handed out through per-CPU
+ * magazines backed by a shared depot. Magazine locks are only contended
+ * by allocations stealing from other CPUs. Every slot handed out holds a
+ * reference, so that the pool outlives the entries still in flight.
+ */
+#define KHASH_POOL_ORDER      4
+#define KHASH_POOL_CHUNK_SIZE (PAGE_SIZE << KHASH_POOL_ORDER)
+#define KHASH_POOL_MAG        32
+
+typedef struct khash_pool_t khash_pool_t;
+
+typedef struct khash_pool_chunk_t {
+	struct khash_pool_chunk_t *next;
+	khash_pool_t              *pool;
+} khash_pool_chunk_t;
 
 typedef struct {
-	DEFINE_KHASH_STRUCT(KHASH_BCK_SIZE_512k)
-} khash_512k_t;
+	spinlock_t lock;
+	uint32_t   n;
+	void       *slot[KHASH_POOL_MAG];
+} khash_pool_mag_t;
+
+struct khash_pool_t {
+	struct percpu_ref         ref;
+	khash_pool_mag_t __percpu *mag;
+	spinlock_t                lock;   /* Depot */
+	void                      *depot; /* Linked through the first word */
+	uint32_t                  ndepot;
+	uint32_t                  capacity;
+	uint32_t                  nchunks;
+	khash_pool_chunk_t        *chunks;
+	struct work_struct        work;
+};
+
+struct khash_t {
+	uint32_t          count;
+	uint32_t          gen;
+	uint8_t           ht_is_static;
+	uint8_t           backing;
+	uint32_t          bck_size;
+	uint32_t          bck_pages;
+	uint32_t          flags;
+	uint32_t          nmulti;
+	uint32_t          vsize;
+	uint32_t          hseed;
+	uint64_t          mem_items;
+	uint64_t          budget;
+	const khash_hash_ops_t *hops;
+	void              *bck;
+	khfunc            dtor;
+	void              *dtor_data;
+	khash_filter_t __rcu *filter;
+	khash_cache_t __rcu  *cache;
+	khash_sketch_t __rcu *sketch;
+	khash_arena_t     *arena;
+	khash_pool_t      *pool;
+	/* With a destructor: kept for khash_term(), and flushed entries
+	 * waiting for a reclaim batch when none could be allocated */
+	struct khash_reclaim_t *reclaim;
+	khash_item_t      *orphans;
+};
+
+__always_inline static khash_item_t *
+khash_chain_entry(struct hlist_node *node)
+{
+	return (node ? hlist_entry(node, khash_item_t, hh) : NULL);
+}
+
+/* Walk one bucket chain; RCU read side or serialized writer */
+#define KHASH_CHAIN_FOR_EACH(__item__, __head__)                               \
+	for ((__item__) = khash_chain_entry(                                       \
+				rcu_dereference_raw(hlist_first_rcu(__head__)));               \
+			(__item__);                                                        \
+			(__item__) = khash_chain_entry(                                    \
+				rcu_dereference_raw(hlist_next_rcu(&(__item__)->hh))))
+
+/* Walk one bucket chain allowing removal of the current entry */
+#define KHASH_CHAIN_FOR_EACH_SAFE(__item__, __tmp__, __head__)                 \
+	for ((__item__) = khash_chain_entry((__head__)->first);                    \
+			(__item__) && ((__tmp__) = (__item__)->hh.next, 1);                \
+			(__item__) = khash_chain_entry(__tmp__))
+
+__always_inline static khash_filter_t *
+khash_filter_get(khash_t *kh)
+{
+	return (rcu_dereference_raw(kh->filter));
+}
+
+/* Double hashing: probe i is h1 + i * h2, h2 odd */
+__always_inline static uint64_t
+khash_filter_seed(khash_key_t hash)
+{
+	return (hash_64(hash.__key._64 ^ ((uint64_t)hash.key << 32 | hash.key),
+			64) | 1);
+}
+
+__always_inline static int
+khash_filter_test(khash_filter_t *f, khash_key_t hash)
+{
+	uint64_t seed = khash_filter_seed(hash);
+	uint32_t h1 = seed >> 32, h2 = seed;
+	uint32_t i;
+
+	this_cpu_inc(f->stats->checks);
+
+	for (i = 0; i < f->nhash; i++) {
+		if (!READ_ONCE(f->ctr[(h1 + i * h2) & f->mask])) {
+			this_cpu_inc(f->stats->skips);
+			return (0);
+		}
+	}
+
+	return (1);
+}
+
+__always_inline static void
+khash_filter_add(khash_filter_t *f, khash_key_t hash)
+{
+	uint64_t seed = khash_filter_seed(hash);
+	uint32_t h1 = seed >> 32, h2 = seed;
+	uint8_t *ctr = NULL;
+	uint32_t i;
+
+	for (i = 0; i < f->nhash; i++) {
+		ctr = &f->ctr[(h1 + i * h2) & f->mask];
+		if (*ctr != KHASH_FILTER_CTR_MAX)
+			WRITE_ONCE(*ctr, *ctr + 1);
+	}
+}
+
+__always_inline static void
+khash_filter_del(khash_filter_t *f, khash_key_t hash)
+{
+	uint64_t seed = khash_filter_seed(hash);
+	uint32_t h1 = seed >> 32, h2 = seed;
+	uint8_t *ctr = NULL;
+	uint32_t i;
+
+	for (i = 0; i < f->nhash; i++) {
+		ctr = &f->ctr[(h1 + i * h2) & f->mask];
+		if (*ctr != KHASH_FILTER_CTR_MAX)
+			WRITE_ONCE(*ctr, *ctr - 1);
+	}
+}
+
+__always_inline static uint64_t
+khash_filter_mem(khash_filter_t *f)
+{
+	return (f ? sizeof(*f) + f->mask + 1 +
+			num_possible_cpus() * sizeof(khash_filter_pcpu_t) : 0);
+}
+
+void khash_filter_reset(khash_t *kh);
+void khash_filter_free(khash_filter_t *f);
+
+__always_inline static khash_cache_t *
+khash_cache_get(khash_t *kh)
+{
+	return (rcu_dereference_raw(kh->cache));
+}
+
+__always_inline static uint32_t
+khash_cache_idx(khash_cache_t *c, khash_key_t hash)
+{
+	return ((hash.key ^ (hash.key >> 16)) & c->mask);
+}
+
+/* After @hash has been unlinked */
+__always_inline static void
+khash_cache_inval(khash_cache_t *c, khash_key_t hash)
+{
+	uint32_t cidx = khash_cache_idx(c, hash);
+
+	smp_wmb();
+	WRITE_ONCE(c->gen[cidx], c->gen[cidx] + 1);
+}
+
+__always_inline static uint64_t
+khash_cache_mem(khash_cache_t *c)
+{
+	return (c ? sizeof(*c) + (c->mask + 1) * sizeof(uint32_t) +
+			num_possible_cpus() * ((c->mask + 1) * sizeof(khash_cache_slot_t) +
+			sizeof(khash_cache_pcpu_t)) : 0);
+}
+
+__always_inline static gfp_t
+khash_gfp(khash_t *kh, gfp_t flags)
+{
+	return ((kh->flags & KHASH_F_ACCOUNT) ? flags | __GFP_ACCOUNT : flags);
+}
+
+void khash_cache_reset(khash_t *kh);
+void khash_cache_free(khash_cache_t *c);
+
+__always_inline static khash_sketch_t *
+khash_sketch_get(khash_t *kh)
+{
+	return (rcu_dereference_raw(kh->sketch));
+}
+
+/* Is this lookup sampled? */
+__always_inline static int
+khash_sketch_tick(khash_sketch_t *s)
+{
+	return (!(this_cpu_inc_return(s->pcpu->tick) & s->mask));
+}
+
+__always_inline static uint64_t
+khash_sketch_mem(khash_sketch_t *s)
+{
+	return (s ? sizeof(*s) + num_possible_cpus() *
+			sizeof(khash_sketch_pcpu_t) : 0);
+}
+
+void khash_sketch_record(khash_sketch_t *s, khash_key_t hash, uint32_t idx);
+/* Chunk memory not holding a live entry */
+__always_inline static uint64_t
+khash_arena_mem(khash_arena_t *a)
+{
+	return (a ? sizeof(*a) + (uint64_t)READ_ONCE(a->nchunks) *
+			KHASH_ARENA_CHUNK_SIZE - (atomic_long_read(&a->ref) - 1) *
+			sizeof(khash_item_t) : 0);
+}
+
+khash_item_t *khash_arena_item_new(khash_arena_t *a, khash_key_t hash,
+		void *value, gfp_t flags);
+void khash_arena_item_free(khash_item_t *item);
+void khash_arena_item_free_rcu(struct rcu_head *rcu);
+void khash_arena_put(khash_arena_t *a);
+
+khash_item_t *khash_pool_item_new(khash_pool_t *p, khash_key_t hash,
+		void *value);
+void khash_pool_item_free(khash_item_t *item);
+void khash_pool_item_free_rcu(struct rcu_head *rcu);
+void khash_pool_put(khash_pool_t *p);
+uint64_t khash_pool_mem(khash_pool_t *p);
+
+extern struct workqueue_struct *khash_wq;
+
+/* Any unlinked entry but multi index ones, past a grace period */
+void khash_item_release(khash_item_t *item);
+
+void khash_sketch_swap(khash_t *kh, khash_sketch_t *s);
+void khash_sketch_free(khash_sketch_t *s);
+
+void khash_hash_bench_run(void);
+
+int khash_ctl_init(void);
+void khash_ctl_exit(void);
+
+int khash_ctl_bpf_lookup(uint32_t id, uint64_t key, uint32_t hash,
+		uint32_t flags, uint64_t *value);
+int khash_ctl_bpf_update(uint32_t id, uint64_t key, uint32_t hash,
+		uint32_t flags, uint64_t value);
+int khash_ctl_bpf_delete(uint32_t id, uint64_t key, uint32_t hash,
+		uint32_t flags);
+
+int khash_bpf_init(void);
+void khash_bpf_exit(void);
 
 #endif
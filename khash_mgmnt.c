@@ -24,48 +24,142 @@
 #include <linux/moduleparam.h>
 #include <linux/version.h>
 #include <linux/vmalloc.h>
+#include <linux/gfp.h>
 #include <linux/in.h>
 #include <linux/in6.h>
 #include <linux/skbuff.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
 #include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/sort.h>
 
 #include "khash.h"
 #include "khash_mgmnt.h"
 #include "khash_internal.h"
 
 #define KHASH_ADD               hash_add_rcu
+#define KHASH_ADD_HEAD          hlist_add_head_rcu
 #define KHASH_DEL               hash_del_rcu
 #define KHASH_FOR_EACH_POSSIBLE hash_for_each_possible_rcu
 #define KHASH_FOR_EACH          hash_for_each_rcu
 
+static unsigned int bulk_bench;
+module_param(bulk_bench, uint, 0444);
+MODULE_PARM_DESC(bulk_bench, "Entries of the bulk vs single entry benchmark at load (0: off)");
+
+static struct kmem_cache *khash_item_cache;
+
 khash_item_t *
 khash_item_new(khash_key_t hash, void *value, gfp_t flags)
 {
 	khash_item_t *item = NULL;
 
-	item = kzalloc(sizeof(khash_item_t), flags);
+	item = kmem_cache_zalloc(khash_item_cache, flags);
 	if (!item)
 		return (NULL);
 
 	item->hash = hash;
 	item->value = value;
+	item->flags = KHASH_ITEM_F_CACHE;
 
 	return (item);
 }
 EXPORT_SYMBOL(khash_item_new);
 
+/* Plain or inline entries only */
+__always_inline static void
+khash_item_free(khash_item_t *item)
+{
+	if (item->flags & KHASH_ITEM_F_CACHE)
+		kmem_cache_free(khash_item_cache, item);
+	else if (item->flags & KHASH_ITEM_F_ARENA)
+		khash_arena_item_free(item);
+	else if (item->flags & KHASH_ITEM_F_POOL)
+		khash_pool_item_free(item);
+	else
+		kfree(item);
+}
+
+static void
+khash_item_free_rcu(struct rcu_head *rcu)
+{
+	kmem_cache_free(khash_item_cache, container_of(rcu, khash_item_t, rcu));
+}
+
+static void
+khash_iitem_free_rcu(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, khash_iitem_tail_t, rcu)->iitem);
+}
+
 void
 khash_item_del(khash_item_t *item)
 {
 	if (unlikely(!item))
 		return;
 
-	kfree(item);
+	khash_item_free(item);
 }
 EXPORT_SYMBOL(khash_item_del);
 
+khash_mitem_t *
+khash_mitem_new(khash_key_t *hash, uint32_t nidx, void *value, gfp_t flags)
+{
+	khash_mitem_t *mitem = NULL;
+	uint32_t i;
+
+	if (unlikely(!hash || !nidx || nidx > KHASH_MITEM_MAX_IDX))
+		return (NULL);
+
+	mitem = kzalloc(sizeof(khash_mitem_t) + nidx * sizeof(khash_item_t),
+			flags);
+	if (!mitem)
+		return (NULL);
+
+	mitem->nidx = nidx;
+	for (i = 0; i < nidx; i++) {
+		mitem->idx[i].hash = hash[i];
+		mitem->idx[i].value = value;
+		mitem->idx[i].flags = KHASH_ITEM_F_MULTI;
+		mitem->idx[i].idx = i;
+	}
+
+	return (mitem);
+}
+EXPORT_SYMBOL(khash_mitem_new);
+
+/* Only for entries which have never been (or are no more) linked */
+void
+khash_mitem_del(khash_mitem_t *mitem)
+{
+	if (unlikely(!mitem))
+		return;
+
+	kfree(mitem);
+}
+EXPORT_SYMBOL(khash_mitem_del);
+
+__always_inline static khash_mitem_t *
+khash_mitem_get(khash_item_t *item)
+{
+	return (container_of(item - item->idx, khash_mitem_t, idx[0]));
+}
+
+/* Memory held by a linked entry, a multi index one is split among its slots */
+__always_inline static uint64_t
+khash_item_mem(khash_t *kh, khash_item_t *item)
+{
+	if (item->flags & KHASH_ITEM_F_INLINE)
+		return (KHASH_IITEM_SIZE(kh->vsize));
+
+	if (item->flags & KHASH_ITEM_F_MULTI)
+		return (sizeof(khash_item_t) +
+				sizeof(khash_mitem_t) / khash_mitem_get(item)->nidx);
+
+	return (sizeof(khash_item_t));
+}
+
 __always_inline static void *
 khash_item_value_get(khash_item_t *item)
 {
@@ -120,18 +214,131 @@ khash_item_value_set(khash_item_t *item, void *value)
 	} while (0)
 #endif
 
+__always_inline static uint32_t
+khash_hash_idx_get(khash_t *kh, khash_key_t hash)
+{
+	uint32_t idx;
+
+	if (unlikely(kh->flags & KHASH_F_SPARSE))
+		idx = hash_32(hash.key, ilog2(kh->bck_size));
+	else if (likely(kh->bck_size == KHASH_BCK_SIZE_512k))
+		idx = hash_min(hash.key, HASH_BITS(((khash_bck_512k_t *)kh->bck)->ht));
+	else if (likely(kh->bck_size == KHASH_BCK_SIZE_1k))
+		idx = hash_min(hash.key, HASH_BITS(((khash_bck_1k_t *)kh->bck)->ht));
+	else
+		idx = hash_min(hash.key, HASH_BITS(((khash_bck_16_t *)kh->bck)->ht));
+
+	return (idx);
+}
+
+static struct hlist_head khash_empty_bck = HLIST_HEAD_INIT;
+
+__always_inline static khash_bck_page_t __rcu **
+khash_bck_dir(khash_t *kh)
+{
+	return ((khash_bck_page_t __rcu **)kh->bck);
+}
+
+__always_inline static khash_bck_page_t *
+khash_bck_page_get(khash_t *kh, uint32_t idx)
+{
+	return (rcu_dereference_raw(khash_bck_dir(kh)[idx >> KHASH_PAGE_BCK_SHIFT]));
+}
+
+__always_inline static khash_item_t *
+__khash_sparse_lookup(khash_t *kh, khash_key_t hash)
+{
+	uint32_t idx = khash_hash_idx_get(kh, hash);
+	khash_bck_page_t *page = NULL;
+	khash_item_t *item = NULL;
+
+	page = khash_bck_page_get(kh, idx);
+	if (!page)
+		return (NULL);
+
+	KHASH_CHAIN_FOR_EACH(item, &page->ht[idx & KHASH_PAGE_BCK_MASK]) {
+		if (khash_key_match(&item->hash, &hash))
+			return (item);
+	}
+
+	return (NULL);
+}
+
+/* Make sure the bucket page @hash falls in exists */
+static int
+khash_bck_reserve(khash_t *kh, khash_key_t hash, gfp_t flags)
+{
+	uint32_t idx = khash_hash_idx_get(kh, hash) >> KHASH_PAGE_BCK_SHIFT;
+	khash_bck_page_t *page = NULL;
+
+	if (likely(!(kh->flags & KHASH_F_SPARSE)))
+		return (0);
+
+	if (rcu_access_pointer(khash_bck_dir(kh)[idx]))
+		return (0);
+
+	page = kzalloc(sizeof(khash_bck_page_t), khash_gfp(kh, flags));
+	if (unlikely(!page))
+		return (-1);
+
+	hash_init(page->ht);
+	rcu_assign_pointer(khash_bck_dir(kh)[idx], page);
+	kh->bck_pages++;
+
+	return (0);
+}
+
+/* Release the bucket page @hash falls in once it is empty */
+static void
+khash_bck_release(khash_t *kh, khash_key_t hash)
+{
+	uint32_t idx = khash_hash_idx_get(kh, hash) >> KHASH_PAGE_BCK_SHIFT;
+	khash_bck_page_t *page = NULL;
+
+	if (likely(!(kh->flags & KHASH_F_SPARSE)))
+		return;
+
+	page = rcu_dereference_raw(khash_bck_dir(kh)[idx]);
+	if (!page || page->count)
+		return;
+
+	RCU_INIT_POINTER(khash_bck_dir(kh)[idx], NULL);
+	kh->bck_pages--;
+	kfree_rcu(page, rcu);
+}
+
+__always_inline static uint32_t
+khash_bck_count_get(khash_t *kh, uint32_t idx)
+{
+	khash_bck_page_t *page = NULL;
+
+	if (likely(!(kh->flags & KHASH_F_SPARSE)))
+		return (((uint32_t *)kh->bck)[idx]);
+
+	page = khash_bck_page_get(kh, idx);
+
+	return (page ? page->ht_count[idx & KHASH_PAGE_BCK_MASK] : 0);
+}
+
 __always_inline static khash_item_t *
 __khash_lookup(khash_t *kh, khash_key_t hash)
 {
+	khash_filter_t *filter = khash_filter_get(kh);
 	khash_item_t *item = NULL;
 	uint8_t found = 0;
 
+	if (unlikely(filter) && !khash_filter_test(filter, hash))
+		return (NULL);
+
+	if (unlikely(kh->flags & KHASH_F_SPARSE))
+		return (__khash_sparse_lookup(kh, hash));
+
 	if (likely(kh->bck_size == KHASH_BCK_SIZE_512k))
-		KHASH_BUCKET_LOOKUP((khash_512k_t *)kh, hash, item, found);
+		KHASH_BUCKET_LOOKUP((khash_bck_512k_t *)kh->bck, hash, item, found);
 	else if (likely(kh->bck_size == KHASH_BCK_SIZE_1k))
-		KHASH_BUCKET_LOOKUP((khash_1k_t *)kh, hash, item, found);
+		KHASH_BUCKET_LOOKUP((khash_bck_1k_t *)kh->bck, hash, item, found);
 	else
-		KHASH_BUCKET_LOOKUP((khash_16_t *)kh, hash, item, found);
+		KHASH_BUCKET_LOOKUP((khash_bck_16_t *)kh->bck, hash, item, found);
 
 	if (!found)
 		return (NULL);
@@ -139,19 +346,132 @@ __khash_lookup(khash_t *kh, khash_key_t hash)
 	return (item);
 }
 
-__always_inline static uint32_t
-khash_hash_idx_get(khash_t *kh, khash_key_t hash)
+/*
+ * The generation is sampled before the walk: an entry unlinked meanwhile
+ * bumps it, so the slot filled below is born stale.
+ */
+__always_inline static khash_item_t *
+__khash_cache_lookup(khash_t *kh, khash_cache_t *cache, khash_key_t hash)
 {
-	uint32_t idx;
+	uint32_t cidx = khash_cache_idx(cache, hash);
+	khash_cache_slot_t *slot = NULL;
+	khash_item_t *item = NULL;
+	uint32_t seq, gen;
+
+	slot = (khash_cache_slot_t *)get_cpu_ptr(cache->slot) + cidx;
+
+	gen = READ_ONCE(cache->gen[cidx]);
+	smp_rmb();
+
+	seq = READ_ONCE(slot->seq);
+	if (likely(!(seq & 1))) {
+		item = READ_ONCE(slot->item);
+		if (item && READ_ONCE(slot->gen) == gen) {
+			barrier();
+			if (READ_ONCE(slot->seq) == seq &&
+					khash_key_match(&item->hash, &hash)) {
+				this_cpu_inc(cache->stats->hits);
+				goto khash_cache_lookup_done;
+			}
+		}
+	}
 
-	if (likely(kh->bck_size == KHASH_BCK_SIZE_512k))
-		idx = hash_min(hash.key, HASH_BITS(((khash_512k_t *)kh)->ht));
-	else if (likely(kh->bck_size == KHASH_BCK_SIZE_1k))
-		idx = hash_min(hash.key, HASH_BITS(((khash_1k_t *)kh)->ht));
-	else
-		idx = hash_min(hash.key, HASH_BITS(((khash_16_t *)kh)->ht));
+	this_cpu_inc(cache->stats->misses);
 
-	return (idx);
+	item = __khash_lookup(kh, hash);
+	if (item && !(seq & 1) && cmpxchg_local(&slot->seq, seq, seq + 1) == seq) {
+		WRITE_ONCE(slot->item, item);
+		WRITE_ONCE(slot->gen, gen);
+		barrier();
+		WRITE_ONCE(slot->seq, seq + 2);
+	}
+
+khash_cache_lookup_done:
+	put_cpu_ptr(cache->slot);
+
+	return (item);
+}
+
+/* Largest physically contiguous allocation the page allocator can serve */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+#define KHASH_MAX_PAGE_ORDER MAX_PAGE_ORDER
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+#define KHASH_MAX_PAGE_ORDER MAX_ORDER
+#else
+#define KHASH_MAX_PAGE_ORDER (MAX_ORDER - 1)
+#endif
+
+__always_inline static uint64_t
+khash_bck_footprint(uint32_t bck_size)
+{
+	switch (bck_size) {
+	case KHASH_BCK_SIZE_512k:
+		return (sizeof(khash_bck_512k_t));
+	case KHASH_BCK_SIZE_1k:
+		return (sizeof(khash_bck_1k_t));
+	case KHASH_BCK_SIZE_16:
+	default:
+		return (sizeof(khash_bck_16_t));
+	}
+}
+
+/*
+ * KHASH_F_HUGE: a bucket array fitting the buddy allocator is taken
+ * physically contiguous, so that it is covered by the huge pages of the
+ * linear mapping; bigger ones use PMD mapped vmalloc() where supported.
+ * Any failure falls back to plain vzalloc().
+ */
+static void *
+khash_bck_alloc(uint32_t bck_size, uint32_t flags, uint8_t *backing)
+{
+	uint64_t size = khash_bck_footprint(bck_size);
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO;
+	void *bck = NULL;
+
+	if (flags & KHASH_F_ACCOUNT)
+		gfp |= __GFP_ACCOUNT;
+
+	if (flags & KHASH_F_HUGE) {
+		if (get_order(size) <= KHASH_MAX_PAGE_ORDER) {
+			bck = alloc_pages_exact(size, gfp | __GFP_NORETRY | __GFP_NOWARN);
+			if (bck) {
+				*backing = KHASH_BACKING_PAGES;
+				return (bck);
+			}
+		}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+		bck = vmalloc_huge(size, gfp);
+		if (bck) {
+			*backing = is_vm_area_hugepages(bck) ?
+					KHASH_BACKING_VMALLOC_HUGE : KHASH_BACKING_VMALLOC;
+			return (bck);
+		}
+#endif
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+	bck = __vmalloc(size, gfp);
+#else
+	bck = __vmalloc(size, gfp, PAGE_KERNEL);
+#endif
+	if (bck)
+		*backing = KHASH_BACKING_VMALLOC;
+
+	return (bck);
+}
+
+static void
+khash_bck_free(void *bck, uint32_t bck_size, uint8_t backing)
+{
+	if (!bck)
+		return;
+
+	if (backing == KHASH_BACKING_SPARSE)
+		kvfree(bck);
+	else if (backing == KHASH_BACKING_PAGES)
+		free_pages_exact(bck, khash_bck_footprint(bck_size));
+	else
+		vfree(bck);
 }
 
 uint64_t
@@ -160,244 +480,1569 @@ khash_footprint(khash_t *kh)
 	if (unlikely(!kh))
 		return (0);
 
-	switch (kh->bck_size) {
-	case KHASH_BCK_SIZE_512k:
-		return (sizeof(khash_512k_t));
-	case KHASH_BCK_SIZE_1k:
-		return (sizeof(khash_1k_t));
-	case KHASH_BCK_SIZE_16:
-	default:
-		return (sizeof(khash_t));
+	if (kh->flags & KHASH_F_SPARSE)
+		return (sizeof(khash_t) +
+				(kh->bck_size >> KHASH_PAGE_BCK_SHIFT) * sizeof(void *) +
+				(uint64_t)kh->bck_pages * sizeof(khash_bck_page_t));
+
+	return (sizeof(khash_t) + khash_bck_footprint(kh->bck_size));
+}
+EXPORT_SYMBOL(khash_footprint);
+
+int
+khash_footprint_get(khash_t *kh, khash_footprint_t *fp)
+{
+	if (unlikely(!kh || !fp))
+		return (-1);
+
+	fp->bytes = khash_footprint(kh);
+	fp->backing = kh->backing;
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_footprint_get);
+
+const char *
+khash_backing_str(uint32_t backing)
+{
+	switch (backing) {
+	case KHASH_BACKING_VMALLOC:
+		return ("vmalloc");
+	case KHASH_BACKING_VMALLOC_HUGE:
+		return ("vmalloc-huge");
+	case KHASH_BACKING_PAGES:
+		return ("pages");
+	case KHASH_BACKING_SPARSE:
+		return ("sparse");
+	case KHASH_BACKING_STATIC:
+		return ("static");
+	default:
+		return ("unknown");
+	}
+}
+EXPORT_SYMBOL(khash_backing_str);
+
+uint64_t
+khash_entry_footprint(void)
+{
+	return (sizeof(khash_item_t));
+}
+EXPORT_SYMBOL(khash_entry_footprint);
+
+/*
+ * Filter, cache, sketch and the unused part of the arena and pool. An
+ * entry taken from the arena or pool has already left their share.
+ */
+__always_inline static uint64_t
+khash_mem_extra(khash_t *kh)
+{
+	return (khash_filter_mem(khash_filter_get(kh)) +
+			khash_cache_mem(khash_cache_get(kh)) +
+			khash_sketch_mem(khash_sketch_get(kh)) +
+			khash_arena_mem(kh->arena) + khash_pool_mem(kh->pool));
+}
+
+/* Lockless, the figures of a table being written are approximate */
+int
+khash_mem_get(khash_t *khash, khash_mem_t *mem)
+{
+	if (unlikely(!khash || !mem))
+		return (-1);
+
+	rcu_read_lock();
+	mem->bck = khash_footprint(khash);
+	mem->items = READ_ONCE(khash->mem_items);
+	mem->extra = khash_mem_extra(khash);
+	rcu_read_unlock();
+
+	mem->total = mem->bck + mem->items + mem->extra;
+	mem->budget = READ_ONCE(khash->budget);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_mem_get);
+
+int
+khash_budget_set(khash_t *khash, uint64_t bytes)
+{
+	if (unlikely(!khash))
+		return (-1);
+
+	WRITE_ONCE(khash->budget, bytes);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_budget_set);
+
+__always_inline static uint32_t
+khash_bck_size_fix(uint32_t bck_size)
+{
+	if (bck_size <= KHASH_BCK_SIZE_16)
+		return (KHASH_BCK_SIZE_16);
+	else if (bck_size <= KHASH_BCK_SIZE_1k)
+		return (KHASH_BCK_SIZE_1k);
+
+	return (KHASH_BCK_SIZE_512k);
+}
+
+static void
+khash_bck_init(void *bck, uint32_t bck_size)
+{
+	switch (bck_size) {
+	case KHASH_BCK_SIZE_512k:
+		hash_init(((khash_bck_512k_t *)bck)->ht);
+		break;
+	case KHASH_BCK_SIZE_1k:
+		hash_init(((khash_bck_1k_t *)bck)->ht);
+		break;
+	case KHASH_BCK_SIZE_16:
+	default:
+		hash_init(((khash_bck_16_t *)bck)->ht);
+		break;
+	}
+}
+
+khash_t *
+khash_init_flags(uint32_t bck_size, uint32_t flags)
+{
+	khash_t *khash = NULL;
+
+	bck_size = khash_bck_size_fix(bck_size);
+
+	/* A 16 buckets table is smaller than a single bucket page */
+	if (bck_size == KHASH_BCK_SIZE_16)
+		flags &= ~KHASH_F_SPARSE;
+
+	khash = kzalloc(sizeof(khash_t), (flags & KHASH_F_ACCOUNT) ?
+			GFP_KERNEL_ACCOUNT : GFP_KERNEL);
+	if (unlikely(!khash))
+		return (NULL);
+
+	if (flags & KHASH_F_SPARSE) {
+		khash->bck = kvzalloc((bck_size >> KHASH_PAGE_BCK_SHIFT) *
+				sizeof(void *), (flags & KHASH_F_ACCOUNT) ?
+				GFP_KERNEL_ACCOUNT : GFP_KERNEL);
+		khash->backing = KHASH_BACKING_SPARSE;
+	} else {
+		khash->bck = khash_bck_alloc(bck_size, flags, &khash->backing);
+	}
+
+	if (unlikely(!khash->bck)) {
+		kfree(khash);
+		return (NULL);
+	}
+
+	if (!(flags & KHASH_F_SPARSE))
+		khash_bck_init(khash->bck, bck_size);
+
+	khash->bck_size = bck_size;
+	khash->flags = flags;
+
+	return (khash);
+}
+EXPORT_SYMBOL(khash_init_flags);
+
+/* The bucket array follows the header, on its own cache lines */
+#define KHASH_STATIC_BCK_OFFSET ALIGN(sizeof(khash_t), L1_CACHE_BYTES)
+
+size_t
+khash_static_size(uint32_t bck_size)
+{
+	return (KHASH_STATIC_BCK_OFFSET +
+			khash_bck_footprint(khash_bck_size_fix(bck_size)));
+}
+EXPORT_SYMBOL(khash_static_size);
+
+khash_t *
+khash_init_static(void *mem, size_t size, uint32_t bck_size)
+{
+	khash_t *khash = mem;
+
+	if (unlikely(!mem || !IS_ALIGNED((unsigned long)mem, sizeof(void *))))
+		return (NULL);
+
+	bck_size = khash_bck_size_fix(bck_size);
+	if (size < khash_static_size(bck_size))
+		return (NULL);
+
+	memset(mem, 0, khash_static_size(bck_size));
+
+	khash->bck = (uint8_t *)mem + KHASH_STATIC_BCK_OFFSET;
+	khash_bck_init(khash->bck, bck_size);
+
+	khash->bck_size = bck_size;
+	khash->backing = KHASH_BACKING_STATIC;
+	khash->ht_is_static = 1;
+
+	return (khash);
+}
+EXPORT_SYMBOL(khash_init_static);
+
+khash_t *
+khash_init(uint32_t bck_size)
+{
+	return (khash_init_flags(bck_size, 0));
+}
+EXPORT_SYMBOL(khash_init);
+
+/* ht_count[] leads every bucket array variant */
+__always_inline static uint32_t *
+khash_ht_count(khash_t *kh)
+{
+	return ((uint32_t *)kh->bck);
+}
+
+__always_inline static void
+__khash_unlink(khash_t *khash, khash_item_t *item)
+{
+	uint32_t idx = khash_hash_idx_get(khash, item->hash);
+	khash_filter_t *filter = khash_filter_get(khash);
+	khash_cache_t *cache = khash_cache_get(khash);
+	khash_bck_page_t *page = NULL;
+
+	KHASH_DEL(&item->hh);
+	if (unlikely(filter))
+		khash_filter_del(filter, item->hash);
+	if (unlikely(cache))
+		khash_cache_inval(cache, item->hash);
+	khash->count--;
+	khash->mem_items -= khash_item_mem(khash, item);
+	if (item->flags & KHASH_ITEM_F_MULTI)
+		khash->nmulti--;
+	WRITE_ONCE(khash->gen, khash->gen + 1);
+
+	if (likely(!(khash->flags & KHASH_F_SPARSE))) {
+		khash_ht_count(khash)[idx]--;
+		return;
+	}
+
+	page = khash_bck_page_get(khash, idx);
+	page->ht_count[idx & KHASH_PAGE_BCK_MASK]--;
+	page->count--;
+	khash_bck_release(khash, item->hash);
+}
+
+__always_inline static void
+__khash_item_free_rcu(khash_item_t *item)
+{
+	khash_mitem_t *mitem = NULL;
+
+	if (likely(item->flags & KHASH_ITEM_F_CACHE)) {
+		call_rcu(&item->rcu, khash_item_free_rcu);
+		return;
+	}
+
+	if (item->flags & KHASH_ITEM_F_ARENA) {
+		call_rcu(&item->rcu, khash_arena_item_free_rcu);
+		return;
+	}
+
+	if (item->flags & KHASH_ITEM_F_POOL) {
+		call_rcu(&item->rcu, khash_pool_item_free_rcu);
+		return;
+	}
+
+	if (item->flags & KHASH_ITEM_F_INLINE) {
+		call_rcu(khash_item_rcu(item), khash_iitem_free_rcu);
+		return;
+	}
+
+	if (likely(!(item->flags & KHASH_ITEM_F_MULTI))) {
+		kfree_rcu(item, rcu);
+		return;
+	}
+
+	mitem = khash_mitem_get(item);
+	mitem->kh[item->idx] = NULL;
+	if (atomic_dec_and_test(&mitem->linked))
+		kfree_rcu(mitem, rcu);
+}
+
+void
+khash_item_release(khash_item_t *item)
+{
+	__khash_item_free_rcu(item);
+}
+
+__always_inline static void
+__khash_rementry(khash_t *khash, khash_item_t *item)
+{
+	__khash_unlink(khash, item);
+	__khash_item_free_rcu(item);
+}
+
+struct workqueue_struct *khash_wq;
+
+/*
+ * Entries detached from a table in one go. They are released by
+ * khash_wq after a single grace period, invoking the table destructor
+ * (if any) on every plain entry; multi index slots are never deferred.
+ */
+typedef struct khash_reclaim_t {
+	struct rcu_head    rcu;
+	struct work_struct work;
+	struct hlist_node  *chains; /* Chain heads, linked through pprev */
+	khash_bck_page_t   *pages;  /* Bucket pages, linked through rcu.next */
+	khash_item_t       *items;  /* Entries, linked through rcu.next */
+	khash_t            *kh;     /* Table to be freed with its bucket array */
+	khfunc             dtor;
+	void               *dtor_data;
+} khash_reclaim_t;
+
+static khash_reclaim_t *
+khash_reclaim_new(khash_t *kh)
+{
+	khash_reclaim_t *r = NULL;
+
+	r = kzalloc(sizeof(khash_reclaim_t), GFP_ATOMIC | __GFP_NOWARN);
+	if (unlikely(!r))
+		return (NULL);
+
+	r->dtor = kh->dtor;
+	r->dtor_data = kh->dtor_data;
+
+	return (r);
+}
+
+/* The descriptor reserved by khash_dtor_set(), for khash_term() only */
+static khash_reclaim_t *
+khash_reclaim_reserved(khash_t *kh)
+{
+	khash_reclaim_t *r = kh->reclaim;
+
+	kh->reclaim = NULL;
+	if (r) {
+		r->dtor = kh->dtor;
+		r->dtor_data = kh->dtor_data;
+	}
+
+	return (r);
+}
+
+__always_inline static void
+khash_reclaim_item(khash_reclaim_t *r, khash_item_t *item)
+{
+	khash_item_rcu(item)->next = (struct rcu_head *)r->items;
+	r->items = item;
+}
+
+/* Entries flushed while no batch could be allocated */
+static void
+khash_reclaim_orphans(khash_reclaim_t *r, khash_t *kh)
+{
+	khash_item_t *item = NULL, *next = NULL;
+
+	for (item = kh->orphans; item; item = next) {
+		next = (khash_item_t *)khash_item_rcu(item)->next;
+		khash_reclaim_item(r, item);
+	}
+	kh->orphans = NULL;
+}
+
+/* Past the grace period: nobody can reach @item anymore */
+static void
+khash_reclaim_free(khash_reclaim_t *r, khash_item_t *item)
+{
+	if (r->dtor)
+		r->dtor(item->hash, item->value, r->dtor_data);
+
+	khash_item_free(item);
+}
+
+static void
+khash_reclaim_chain(khash_reclaim_t *r, struct hlist_node *node)
+{
+	struct hlist_node *tmp = NULL;
+	khash_item_t *item = NULL;
+
+	for (item = khash_chain_entry(node); item; item = khash_chain_entry(tmp)) {
+		tmp = item->hh.next;
+		khash_reclaim_free(r, item);
+	}
+}
+
+static void
+khash_reclaim_work(struct work_struct *work)
+{
+	khash_reclaim_t *r = container_of(work, khash_reclaim_t, work);
+	khash_bck_page_t *page = NULL, *next_page = NULL;
+	struct hlist_node *chain = NULL, *next_chain = NULL;
+	khash_item_t *item = NULL, *next = NULL;
+	uint32_t j;
+
+	for (chain = r->chains; chain; chain = next_chain) {
+		next_chain = (struct hlist_node *)chain->pprev;
+		khash_reclaim_chain(r, chain);
+		cond_resched();
+	}
+
+	for (page = r->pages; page; page = next_page) {
+		next_page = (khash_bck_page_t *)page->rcu.next;
+		for (j = 0; j < KHASH_PAGE_BCK_SIZE; j++)
+			khash_reclaim_chain(r, page->ht[j].first);
+		kfree(page);
+		cond_resched();
+	}
+
+	for (item = r->items; item; item = next) {
+		next = (khash_item_t *)khash_item_rcu(item)->next;
+		khash_reclaim_free(r, item);
+	}
+
+	if (r->kh) {
+		khash_filter_free(khash_filter_get(r->kh));
+		khash_cache_free(khash_cache_get(r->kh));
+		khash_sketch_free(khash_sketch_get(r->kh));
+		khash_arena_put(r->kh->arena);
+		khash_bck_free(r->kh->bck, r->kh->bck_size, r->kh->backing);
+		kfree(r->kh);
+	}
+
+	kfree(r);
+}
+
+static void
+khash_reclaim_rcu(struct rcu_head *rcu)
+{
+	khash_reclaim_t *r = container_of(rcu, khash_reclaim_t, rcu);
+
+	INIT_WORK(&r->work, khash_reclaim_work);
+	queue_work(khash_wq, &r->work);
+}
+
+static void
+khash_reclaim_submit(khash_reclaim_t *r)
+{
+	call_rcu(&r->rcu, khash_reclaim_rcu);
+}
+
+/*
+ * Chains are taken away by clearing the bucket heads only: readers still
+ * walking them keep following hh.next, which is left untouched, while
+ * the pprev of the first entry (never used on the read side) threads the
+ * detached chains together. This is O(bck_size), not O(1): swapping in
+ * an empty array would take a vmalloc() of up to several MB, which
+ * khash_flush() from atomic context cannot do, so the writer pays one
+ * sequential pass over the heads and ht_count[] instead (~6 MB of stores
+ * on a 512k table), and none over the entries.
+ */
+static void
+khash_flush_chains(khash_t *kh, khash_reclaim_t *r)
+{
+	struct hlist_head *ht = khash_bck_get(kh, 0);
+	struct hlist_node *first = NULL;
+	uint32_t i;
+
+	for (i = 0; i < kh->bck_size; i++) {
+		first = ht[i].first;
+		if (!first)
+			continue;
+
+		RCU_INIT_POINTER(hlist_first_rcu(&ht[i]), NULL);
+		first->pprev = (struct hlist_node **)r->chains;
+		r->chains = first;
+	}
+
+	memset(khash_ht_count(kh), 0, kh->bck_size * sizeof(uint32_t));
+}
+
+static void
+khash_flush_pages(khash_t *kh, khash_reclaim_t *r)
+{
+	khash_bck_page_t *page = NULL;
+	uint32_t i;
+
+	for (i = 0; i < (kh->bck_size >> KHASH_PAGE_BCK_SHIFT); i++) {
+		page = rcu_dereference_raw(khash_bck_dir(kh)[i]);
+		if (!page)
+			continue;
+
+		RCU_INIT_POINTER(khash_bck_dir(kh)[i], NULL);
+		page->rcu.next = (struct rcu_head *)r->pages;
+		r->pages = page;
+	}
+
+	kh->bck_pages = 0;
+}
+
+/*
+ * One entry at a time; plain entries go to @r when there is one, else
+ * they wait on kh->orphans for the next batch as long as the destructor
+ * has to see them.
+ */
+static void
+khash_flush_items(khash_t *kh, khash_reclaim_t *r)
+{
+	struct hlist_node *tmp = NULL;
+	khash_item_t *item = NULL;
+	uint32_t i;
+
+	for (i = 0; i < kh->bck_size; i++) {
+		/* A bucket page is released with its last entry */
+		rcu_read_lock();
+		KHASH_CHAIN_FOR_EACH_SAFE(item, tmp, khash_bck_get(kh, i)) {
+			__khash_unlink(kh, item);
+			if (item->flags & KHASH_ITEM_F_MULTI) {
+				__khash_item_free_rcu(item);
+			} else if (r) {
+				khash_reclaim_item(r, item);
+			} else if (kh->dtor) {
+				khash_item_rcu(item)->next = (struct rcu_head *)kh->orphans;
+				kh->orphans = item;
+			} else {
+				__khash_item_free_rcu(item);
+			}
+		}
+		rcu_read_unlock();
+	}
+}
+
+/*
+ * Multi index slots have to be unlinked from the other tables' point of
+ * view right away, so they force the entry by entry path.
+ */
+static void
+__khash_flush(khash_t *kh, khash_reclaim_t *r)
+{
+	if (!r || kh->nmulti)
+		khash_flush_items(kh, r);
+	else if (kh->flags & KHASH_F_SPARSE)
+		khash_flush_pages(kh, r);
+	else
+		khash_flush_chains(kh, r);
+
+	if (r)
+		khash_reclaim_orphans(r, kh);
+
+	khash_filter_reset(kh);
+	khash_cache_reset(kh);
+	kh->count = 0;
+	kh->mem_items = 0;
+	WRITE_ONCE(kh->gen, kh->gen + 1);
+}
+
+void
+khash_flush(khash_t *kh)
+{
+	khash_reclaim_t *r = NULL;
+
+	if (!kh)
+		return;
+
+	r = khash_reclaim_new(kh);
+	__khash_flush(kh, r);
+	if (r)
+		khash_reclaim_submit(r);
+}
+EXPORT_SYMBOL(khash_flush);
+
+void
+khash_term(khash_t *kh)
+{
+	khash_reclaim_t *r = NULL;
+	khash_pool_t *pool = NULL;
+
+	if (unlikely(!kh))
+		return;
+
+	pool = kh->pool;
+
+	/* With a destructor there is always one, reserved by khash_dtor_set() */
+	r = khash_reclaim_new(kh);
+	if (!r)
+		r = khash_reclaim_reserved(kh);
+	kfree(kh->reclaim);
+	kh->reclaim = NULL;
+
+	if (kh->ht_is_static) {
+		khash_filter_disable(kh);
+		khash_cache_disable(kh);
+		khash_sketch_swap(kh, NULL);
+		__khash_flush(kh, r);
+		if (r)
+			khash_reclaim_submit(r);
+		khash_arena_put(kh->arena);
+		khash_pool_put(pool);
+		memset(kh, 0, sizeof(*kh));
+		return;
+	}
+
+	__khash_flush(kh, r);
+	if (r) {
+		r->kh = kh;
+		khash_reclaim_submit(r);
+		khash_pool_put(pool);
+		return;
+	}
+
+	khash_filter_free(khash_filter_get(kh));
+	khash_cache_free(khash_cache_get(kh));
+	khash_sketch_free(khash_sketch_get(kh));
+	khash_arena_put(kh->arena);
+	khash_pool_put(pool);
+	khash_bck_free(kh->bck, kh->bck_size, kh->backing);
+	kfree(kh);
+}
+EXPORT_SYMBOL(khash_term);
+
+int
+khash_dtor_set(khash_t *khash, khfunc dtor, void *data)
+{
+	if (unlikely(!khash))
+		return (-1);
+
+	/* khash_term() never loses entries to an allocation failure */
+	if (dtor && !khash->reclaim) {
+		khash->reclaim = kzalloc(sizeof(khash_reclaim_t), GFP_KERNEL);
+		if (unlikely(!khash->reclaim))
+			return (-1);
+	}
+
+	khash->dtor = dtor;
+	khash->dtor_data = data;
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_dtor_set);
+
+int
+khash_rementry(khash_t *khash, khash_key_t hash, void **retval)
+{
+	khash_item_t *item = NULL;
+	void *value = NULL;
+
+	if (!khash)
+		goto khash_rementry_fail;
+
+	item = __khash_lookup(khash, hash);
+	if (!item)
+		goto khash_rementry_fail;
+
+	/* Inline data goes away with the entry, nothing to hand back */
+	if (!khash->vsize)
+		value = item->value;
+
+	__khash_rementry(khash, item);
+
+	if (retval)
+		*retval = value;
+	return (0);
+
+khash_rementry_fail:
+	if (retval)
+		*retval = NULL;
+	return (-1);
+}
+EXPORT_SYMBOL(khash_rementry);
+
+/* Bucket page (if any) MUST have been reserved by khash_bck_reserve() */
+__always_inline static void
+__khash_add_item(khash_t *khash, khash_item_t *item)
+{
+	uint32_t idx = khash_hash_idx_get(khash, item->hash);
+	khash_filter_t *filter = khash_filter_get(khash);
+	khash_bck_page_t *page = NULL;
+
+	/* Accounted before being reachable: the filter never hides it */
+	if (unlikely(filter))
+		khash_filter_add(filter, item->hash);
+
+	khash->count++;
+	khash->mem_items += khash_item_mem(khash, item);
+	if (item->flags & KHASH_ITEM_F_MULTI)
+		khash->nmulti++;
+	WRITE_ONCE(khash->gen, khash->gen + 1);
+
+	if (unlikely(khash->flags & KHASH_F_SPARSE)) {
+		page = khash_bck_page_get(khash, idx);
+		KHASH_ADD_HEAD(&item->hh, &page->ht[idx & KHASH_PAGE_BCK_MASK]);
+		page->ht_count[idx & KHASH_PAGE_BCK_MASK]++;
+		page->count++;
+		return;
+	}
+
+	switch (khash->bck_size) {
+	case KHASH_BCK_SIZE_512k:
+		KHASH_ADD(((khash_bck_512k_t *)khash->bck)->ht, &item->hh, item->hash.key);
+		break;
+	case KHASH_BCK_SIZE_1k:
+		KHASH_ADD(((khash_bck_1k_t *)khash->bck)->ht, &item->hh, item->hash.key);
+		break;
+	case KHASH_BCK_SIZE_16:
+	default:
+		KHASH_ADD(((khash_bck_16_t *)khash->bck)->ht, &item->hh, item->hash.key);
+		break;
+	}
+
+	khash_ht_count(khash)[idx]++;
+}
+
+/*
+ * Would linking @item (and its bucket page) exceed the table budget? The
+ * budget is held against the khash_mem_get() total.
+ */
+static int
+khash_budget_check(khash_t *kh, khash_item_t *item)
+{
+	uint64_t need;
+
+	if (likely(!kh->budget))
+		return (0);
+
+	need = khash_footprint(kh) + kh->mem_items + khash_item_mem(kh, item) +
+			khash_mem_extra(kh);
+
+	if ((kh->flags & KHASH_F_SPARSE) &&
+			!khash_bck_page_get(kh, khash_hash_idx_get(kh, item->hash)))
+		need += sizeof(khash_bck_page_t);
+
+	return (need > kh->budget ? -1 : 0);
+}
+
+/* @flags are only used to allocate a missing bucket page */
+static int
+khash_link_item(khash_t *khash, khash_item_t *item, gfp_t flags)
+{
+	khash_item_t *old_item = NULL;
+
+	old_item = __khash_lookup(khash, item->hash);
+	if (old_item)
+		return (-1);
+
+	if (khash_budget_check(khash, item) < 0)
+		return (-1);
+
+	if (khash_bck_reserve(khash, item->hash, flags) < 0)
+		return (-1);
+
+	__khash_add_item(khash, item);
+
+	return (0);
+}
+
+int
+khash_add_item(khash_t *khash, khash_item_t *item)
+{
+	if (!khash || !item || khash->vsize)
+		return (-1);
+
+	return (khash_link_item(khash, item, GFP_ATOMIC));
+}
+EXPORT_SYMBOL(khash_add_item);
+
+/*
+ * All or nothing: the entry is linked into khash[i] with its i-th key for
+ * every index, or into none of them if any key is already present.
+ * Writers of all the involved tables have to be serialized by the caller.
+ */
+int
+khash_add_mitem(khash_t **khash, khash_mitem_t *mitem)
+{
+	uint32_t i, j;
+
+	if (!khash || !mitem)
+		return (-1);
+
+	for (i = 0; i < mitem->nidx; i++) {
+		if (!khash[i] || khash[i]->vsize ||
+				__khash_lookup(khash[i], mitem->idx[i].hash) ||
+				khash_budget_check(khash[i], &mitem->idx[i]) < 0)
+			return (-1);
+
+		for (j = 0; j < i; j++) {
+			if (khash[j] == khash[i] &&
+					khash_key_match(&mitem->idx[j].hash, &mitem->idx[i].hash))
+				return (-1);
+		}
+	}
+
+	for (i = 0; i < mitem->nidx; i++) {
+		if (khash_bck_reserve(khash[i], mitem->idx[i].hash, GFP_ATOMIC) < 0)
+			goto khash_add_mitem_fail;
+	}
+
+	atomic_set(&mitem->linked, mitem->nidx);
+
+	for (i = 0; i < mitem->nidx; i++) {
+		mitem->kh[i] = khash[i];
+		__khash_add_item(khash[i], &mitem->idx[i]);
+	}
+
+	return (0);
+
+khash_add_mitem_fail:
+	while (i--)
+		khash_bck_release(khash[i], mitem->idx[i].hash);
+	return (-1);
+}
+EXPORT_SYMBOL(khash_add_mitem);
+
+int
+khash_addentry_multi(khash_t **khash, khash_key_t *hash, uint32_t nidx,
+		void *value, gfp_t flags)
+{
+	khash_mitem_t *mitem = NULL;
+
+	if (unlikely(!khash))
+		return (-1);
+
+	mitem = khash_mitem_new(hash, nidx, value, flags);
+	if (unlikely(!mitem))
+		return (-1);
+
+	if (khash_add_mitem(khash, mitem) < 0) {
+		kfree(mitem);
+		return (-1);
+	}
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_addentry_multi);
+
+/*
+ * Lookup @hash in @khash and remove the entry from every table it is
+ * linked into. On a plain entry it behaves like khash_rementry().
+ */
+int
+khash_rementry_multi(khash_t *khash, khash_key_t hash, void **retval)
+{
+	khash_mitem_t *mitem = NULL;
+	khash_item_t *item = NULL;
+	void *value = NULL;
+	uint32_t i;
+
+	if (!khash)
+		goto khash_rementry_multi_fail;
+
+	item = __khash_lookup(khash, hash);
+	if (!item)
+		goto khash_rementry_multi_fail;
+
+	value = item->value;
+
+	if (!(item->flags & KHASH_ITEM_F_MULTI)) {
+		__khash_rementry(khash, item);
+	} else {
+		/* Keep mitem alive until the last slot has been visited */
+		rcu_read_lock();
+		mitem = khash_mitem_get(item);
+		for (i = 0; i < mitem->nidx; i++) {
+			if (mitem->kh[i])
+				__khash_rementry(mitem->kh[i], &mitem->idx[i]);
+		}
+		rcu_read_unlock();
+	}
+
+	if (retval)
+		*retval = value;
+	return (0);
+
+khash_rementry_multi_fail:
+	if (retval)
+		*retval = NULL;
+	return (-1);
+}
+EXPORT_SYMBOL(khash_rementry_multi);
+
+/* Plain entry from the table pool, arena or the slab */
+static khash_item_t *
+khash_item_alloc(khash_t *kh, khash_key_t hash, void *value, gfp_t flags)
+{
+	khash_item_t *item = NULL;
+
+	if (kh->pool)
+		return (khash_pool_item_new(kh->pool, hash, value));
+
+	if (kh->arena)
+		item = khash_arena_item_new(kh->arena, hash, value,
+				khash_gfp(kh, flags));
+
+	/* An arena short of high order pages falls back to the slab */
+	if (!item)
+		item = khash_item_new(hash, value, khash_gfp(kh, flags));
+
+	return (item);
+}
+
+int
+khash_addentry(khash_t *khash, khash_key_t hash, void *value, gfp_t flags)
+{
+	khash_item_t *item = NULL;
+
+	if (unlikely(!khash || khash->vsize))
+		return (-1);
+
+	item = khash_item_alloc(khash, hash, value, flags);
+	if (unlikely(!item))
+		return (-1);
+
+	if (khash_link_item(khash, item, flags) < 0) {
+		khash_item_free(item);
+		return (-1);
+	}
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_addentry);
+
+int
+khash_replace(khash_t *khash, khash_key_t hash, void *value, void **retval)
+{
+	khash_item_t *item = NULL;
+
+	if (retval)
+		*retval = NULL;
+
+	if (unlikely(!khash || khash->vsize))
+		return (-1);
+
+	item = __khash_lookup(khash, hash);
+	if (!item || (item->flags & KHASH_ITEM_F_MULTI))
+		return (-1);
+
+	if (retval)
+		*retval = item->value;
+
+	/* Pairs with the address dependency of the readers */
+	smp_store_release(&item->value, value);
+	WRITE_ONCE(khash->gen, khash->gen + 1);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_replace);
+
+/* Reader side lookup, through the front cache when there is one */
+__always_inline static khash_item_t *
+__khash_find(khash_t *kh, khash_key_t hash)
+{
+	khash_cache_t *cache = khash_cache_get(kh);
+	khash_sketch_t *sketch = khash_sketch_get(kh);
+
+	if (unlikely(sketch) && khash_sketch_tick(sketch))
+		khash_sketch_record(sketch, hash, khash_hash_idx_get(kh, hash));
+
+	if (unlikely(cache))
+		return (__khash_cache_lookup(kh, cache, hash));
+
+	return (__khash_lookup(kh, hash));
+}
+
+int
+khash_lookup(khash_t *khash, khash_key_t hash, void **retval)
+{
+	khash_item_t *item = NULL;
+
+	if (unlikely(!khash))
+		goto khash_lookup_fail;
+
+	item = __khash_find(khash, hash);
+	if (!item)
+		goto khash_lookup_fail;
+
+	if (retval)
+		*retval = (rcu_dereference(item))->value;
+
+	return (0);
+
+khash_lookup_fail:
+	if (retval)
+		*retval = NULL;
+
+	return (-1);
+}
+EXPORT_SYMBOL(khash_lookup);
+
+khash_t *
+khash_init_inline(uint32_t bck_size, uint32_t flags, uint32_t value_size)
+{
+	khash_t *khash = NULL;
+
+	if (unlikely(!value_size || value_size > KHASH_INLINE_MAX_SIZE))
+		return (NULL);
+
+	/* An inline entry is walked as a khash_item_t up to idx */
+	BUILD_BUG_ON(offsetof(khash_iitem_t, hash) !=
+			offsetof(khash_item_t, hash));
+	BUILD_BUG_ON(offsetof(khash_iitem_t, value) !=
+			offsetof(khash_item_t, value));
+	BUILD_BUG_ON(offsetof(khash_iitem_t, flags) !=
+			offsetof(khash_item_t, flags));
+	BUILD_BUG_ON(offsetof(khash_iitem_t, idx) !=
+			offsetof(khash_item_t, idx));
+	BUILD_BUG_ON(KHASH_IITEM_TAIL(KHASH_INLINE_MAX_SIZE) > U16_MAX);
+
+	khash = khash_init_flags(bck_size, flags);
+	if (unlikely(!khash))
+		return (NULL);
+
+	khash->vsize = value_size;
+
+	return (khash);
+}
+EXPORT_SYMBOL(khash_init_inline);
+
+static khash_item_t *
+khash_iitem_new(khash_t *kh, khash_key_t hash, const void *value, gfp_t flags)
+{
+	khash_iitem_t *iitem = NULL;
+
+	iitem = kzalloc(KHASH_IITEM_SIZE(kh->vsize), khash_gfp(kh, flags));
+	if (unlikely(!iitem))
+		return (NULL);
+
+	iitem->hash = hash;
+	iitem->value = iitem->data;
+	iitem->flags = KHASH_ITEM_F_INLINE;
+	iitem->idx = KHASH_IITEM_TAIL(kh->vsize);
+	khash_iitem_tail((khash_item_t *)iitem)->iitem = iitem;
+	seqcount_init(&iitem->seq);
+	memcpy(iitem->data, value, kh->vsize);
+
+	return ((khash_item_t *)iitem);
+}
+
+int
+khash_addentry_inline(khash_t *khash, khash_key_t hash, const void *value,
+		gfp_t flags)
+{
+	khash_item_t *item = NULL;
+
+	if (unlikely(!khash || !khash->vsize || !value))
+		return (-1);
+
+	item = khash_iitem_new(khash, hash, value, flags);
+	if (unlikely(!item))
+		return (-1);
+
+	if (khash_link_item(khash, item, flags) < 0) {
+		khash_item_free(item);
+		return (-1);
+	}
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_addentry_inline);
+
+/*
+ * Writers are serialized by the caller; BHs are kept off so that a
+ * reader can never spin on a write section it has interrupted.
+ */
+int
+khash_update_inline(khash_t *khash, khash_key_t hash, const void *value)
+{
+	khash_iitem_t *iitem = NULL;
+	khash_item_t *item = NULL;
+
+	if (unlikely(!khash || !khash->vsize || !value))
+		return (-1);
+
+	item = __khash_lookup(khash, hash);
+	if (!item)
+		return (-1);
+
+	iitem = khash_iitem_get(item);
+
+	local_bh_disable();
+	write_seqcount_begin(&iitem->seq);
+	memcpy(iitem->data, value, khash->vsize);
+	write_seqcount_end(&iitem->seq);
+	local_bh_enable();
+
+	WRITE_ONCE(khash->gen, khash->gen + 1);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_update_inline);
+
+/* Requires rcu_read_lock() */
+int
+khash_lookup_copy(khash_t *khash, khash_key_t hash, void *buf)
+{
+	khash_iitem_t *iitem = NULL;
+	khash_item_t *item = NULL;
+	unsigned int seq;
+
+	if (unlikely(!khash || !khash->vsize || !buf))
+		return (-1);
+
+	item = __khash_find(khash, hash);
+	if (!item)
+		return (-1);
+
+	iitem = khash_iitem_get(item);
+
+	do {
+		seq = read_seqcount_begin(&iitem->seq);
+		memcpy(buf, iitem->data, khash->vsize);
+	} while (read_seqcount_retry(&iitem->seq, seq));
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_lookup_copy);
+
+/* Entries allocated per kmem_cache_alloc_bulk() round */
+#define KHASH_BULK_ALLOC 32
+
+/* Plain entries for ent[idx[0..m)] */
+static int
+khash_bulk_alloc(khash_t *kh, khash_bulk_t *ent, uint32_t *idx, uint32_t m,
+		gfp_t flags)
+{
+	void *p[KHASH_BULK_ALLOC];
+	khash_item_t *item = NULL;
+	uint32_t j;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
+	if (!kmem_cache_alloc_bulk(khash_item_cache, khash_gfp(kh, flags), m, p))
+		return (-1);
+#else
+	for (j = 0; j < m; j++) {
+		p[j] = kmem_cache_alloc(khash_item_cache, khash_gfp(kh, flags));
+		if (!p[j]) {
+			while (j--)
+				kmem_cache_free(khash_item_cache, p[j]);
+			return (-1);
+		}
+	}
+#endif
+
+	for (j = 0; j < m; j++) {
+		item = p[j];
+		memset(item, 0, sizeof(khash_item_t));
+		item->hash = ent[idx[j]].hash;
+		item->value = ent[idx[j]].value;
+		item->flags = KHASH_ITEM_F_CACHE;
+		ent[idx[j]].item = item;
+	}
+
+	return (0);
+}
+
+int
+khash_bulk_prepare(khash_t *khash, khash_bulk_t *ent, uint32_t n, gfp_t flags)
+{
+	uint32_t idx[KHASH_BULK_ALLOC];
+	uint32_t i, m = 0, ready = 0;
+
+	if (unlikely(!khash || (!ent && n)))
+		return (-1);
+
+	for (i = 0; i < n; i++) {
+		if (ent[i].item) {
+			ready++;
+			continue;
+		}
+
+		if (khash->vsize) {
+			if (!ent[i].value)
+				continue;
+			ent[i].item = khash_iitem_new(khash, ent[i].hash, ent[i].value,
+					flags);
+			ready += !!ent[i].item;
+			continue;
+		}
+
+		if (khash->pool || khash->arena) {
+			ent[i].item = khash_item_alloc(khash, ent[i].hash, ent[i].value,
+					flags);
+			ready += !!ent[i].item;
+			continue;
+		}
+
+		idx[m++] = i;
+		if (m < KHASH_BULK_ALLOC)
+			continue;
+
+		if (khash_bulk_alloc(khash, ent, idx, m, flags) < 0)
+			return (ready);
+		ready += m;
+		m = 0;
 	}
+
+	if (m && !khash_bulk_alloc(khash, ent, idx, m, flags))
+		ready += m;
+
+	return (ready);
 }
-EXPORT_SYMBOL(khash_footprint);
+EXPORT_SYMBOL(khash_bulk_prepare);
 
-uint64_t
-khash_entry_footprint(void)
+static int
+khash_bulk_cmp(const void *a, const void *b)
 {
-	return (sizeof(khash_item_t));
+	const khash_bulk_t *ea = a, *eb = b;
+
+	return (ea->status - eb->status);
 }
-EXPORT_SYMBOL(khash_entry_footprint);
 
-khash_t *
-khash_init(uint32_t bck_size)
+/* status holds the bucket index while sorting */
+static void
+khash_bulk_sort(khash_t *kh, khash_bulk_t *ent, uint32_t n)
 {
-	khash_t *khash = NULL;
+	uint32_t i;
 
-	if (bck_size <= KHASH_BCK_SIZE_16)
-		bck_size = KHASH_BCK_SIZE_16;
-	else if (bck_size <= KHASH_BCK_SIZE_1k)
-		bck_size = KHASH_BCK_SIZE_1k;
-	else
-		bck_size = KHASH_BCK_SIZE_512k;
+	for (i = 0; i < n; i++)
+		ent[i].status = khash_hash_idx_get(kh, ent[i].hash);
 
-	switch (bck_size) {
-	case KHASH_BCK_SIZE_512k:
-		khash = vzalloc(sizeof(khash_512k_t));
-		if (unlikely(!khash))
-			return (NULL);
+	sort(ent, n, sizeof(khash_bulk_t), khash_bulk_cmp, NULL);
+}
 
-		hash_init(((khash_512k_t *)khash)->ht);
-		break;
-	case KHASH_BCK_SIZE_1k:
-		khash = vzalloc(sizeof(khash_1k_t));
-		if (unlikely(!khash))
-			return (NULL);
+/* Applies the net change of a batch in bucket @idx, @hash falls in it */
+static void
+khash_bck_account(khash_t *kh, uint32_t idx, khash_key_t hash, int32_t n,
+		int64_t mem, int32_t nmulti)
+{
+	khash_bck_page_t *page = NULL;
 
-		hash_init(((khash_1k_t *)khash)->ht);
-		break;
-	case KHASH_BCK_SIZE_16:
-	default:
-		khash = vzalloc(sizeof(khash_16_t));
-		if (unlikely(!khash))
-			return (NULL);
+	kh->count += n;
+	kh->mem_items += mem;
+	kh->nmulti += nmulti;
+	WRITE_ONCE(kh->gen, kh->gen + 1);
 
-		hash_init(((khash_16_t *)khash)->ht);
-		break;
+	if (likely(!(kh->flags & KHASH_F_SPARSE))) {
+		khash_ht_count(kh)[idx] += n;
+		return;
 	}
 
-	khash->bck_size = bck_size;
-
-	return (khash);
+	page = khash_bck_page_get(kh, idx);
+	page->ht_count[idx & KHASH_PAGE_BCK_MASK] += n;
+	page->count += n;
+	khash_bck_release(kh, hash);
 }
-EXPORT_SYMBOL(khash_init);
 
-__always_inline void
-__khash_rementry(khash_t *khash, khash_item_t *item)
+__always_inline static khash_item_t *
+khash_chain_lookup(struct hlist_head *head, khash_key_t hash)
 {
-	khash->ht_count[khash_hash_idx_get(khash, item->hash)]--;
-	khash->count--;
+	khash_item_t *item = NULL;
 
-	KHASH_DEL(&item->hh);
+	KHASH_CHAIN_FOR_EACH(item, head) {
+		if (khash_key_match(&item->hash, &hash))
+			return (item);
+	}
 
-	kfree_rcu(item, rcu);
+	return (NULL);
 }
 
-void
-khash_flush(khash_t *kh)
+/*
+ * Links the run @ent[0..n) of bucket @idx: every key is looked up in the
+ * chain alone, the budget and the counters are settled once for the run.
+ */
+static uint32_t
+khash_add_bck(khash_t *kh, uint32_t idx, khash_bulk_t *ent, uint32_t n,
+		gfp_t flags)
 {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-	struct hlist_node *n;
-#endif
+	khash_filter_t *filter = khash_filter_get(kh);
+	struct hlist_head *head = NULL;
 	khash_item_t *item = NULL;
-	int idx;
+	uint64_t mem = 0, need = 0, sz;
+	uint32_t i, linked = 0;
 
-	if (!kh)
-		return;
+	for (i = 0; i < n; i++)
+		ent[i].status = -1;
 
-	switch (kh->bck_size) {
-	case KHASH_BCK_SIZE_512k:
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-		KHASH_FOR_EACH(((khash_512k_t *)kh)->ht, idx, n, item, hh) {
-#else
-		KHASH_FOR_EACH(((khash_512k_t *)kh)->ht, idx, item, hh) {
-#endif
-			__khash_rementry(kh, item);
-		}
-		break;
-	case KHASH_BCK_SIZE_1k:
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-		KHASH_FOR_EACH(((khash_1k_t *)kh)->ht, idx, n, item, hh) {
-#else
-		KHASH_FOR_EACH(((khash_1k_t *)kh)->ht, idx, item, hh) {
-#endif
-			__khash_rementry(kh, item);
-		}
-		break;
-	case KHASH_BCK_SIZE_16:
-	default:
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
-		KHASH_FOR_EACH(((khash_16_t *)kh)->ht, idx, n, item, hh) {
-#else
-		KHASH_FOR_EACH(((khash_16_t *)kh)->ht, idx, item, hh) {
-#endif
-			__khash_rementry(kh, item);
-		}
-		break;
+	if (kh->budget) {
+		need = khash_footprint(kh) + kh->mem_items + khash_mem_extra(kh);
+		if ((kh->flags & KHASH_F_SPARSE) && !khash_bck_page_get(kh, idx))
+			need += sizeof(khash_bck_page_t);
+	}
+
+	if (khash_bck_reserve(kh, ent[0].hash, flags) < 0)
+		return (0);
+	head = khash_bck_get(kh, idx);
+
+	for (i = 0; i < n; i++) {
+		item = ent[i].item;
+		if (!item || khash_chain_lookup(head, item->hash))
+			continue;
+
+		sz = khash_item_mem(kh, item);
+		if (kh->budget && need + mem + sz > kh->budget)
+			continue;
+
+		/* Accounted before being reachable: the filter never hides it */
+		if (unlikely(filter))
+			khash_filter_add(filter, item->hash);
+		KHASH_ADD_HEAD(&item->hh, head);
+
+		mem += sz;
+		ent[i].status = 0;
+		ent[i].item = NULL;
+		linked++;
 	}
+
+	if (linked)
+		khash_bck_account(kh, idx, ent[0].hash, linked, mem, 0);
+	else
+		khash_bck_release(kh, ent[0].hash);
+
+	return (linked);
 }
-EXPORT_SYMBOL(khash_flush);
 
-void
-khash_term(khash_t *kh)
+/* Sorted runs share a bucket, status holds its index until visited */
+__always_inline static uint32_t
+khash_bulk_run(khash_bulk_t *ent, uint32_t i, uint32_t n)
 {
-	if (unlikely(!kh))
-		return;
+	uint32_t j;
 
-	khash_flush(kh);
+	for (j = i + 1; j < n && ent[j].status == ent[i].status; j++)
+		;
 
-	if (kh->ht_is_static)
-		memset(kh, 0, sizeof(*kh));
-	else
-		vfree(kh);
+	return (j);
 }
-EXPORT_SYMBOL(khash_term);
 
 int
-khash_rementry(khash_t *khash, khash_key_t hash, void **retval)
+khash_add_bulk(khash_t *khash, khash_bulk_t *ent, uint32_t n, gfp_t flags)
+{
+	uint32_t i, j;
+	int done = 0;
+
+	if (unlikely(!khash || (!ent && n)))
+		return (-1);
+
+	khash_bulk_prepare(khash, ent, n, flags);
+	khash_bulk_sort(khash, ent, n);
+
+	for (i = 0; i < n; i = j) {
+		j = khash_bulk_run(ent, i, n);
+		done += khash_add_bck(khash, ent[i].status, &ent[i], j - i, flags);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (ent[i].item)
+			khash_item_free(ent[i].item);
+		ent[i].item = NULL;
+	}
+
+	return (done);
+}
+EXPORT_SYMBOL(khash_add_bulk);
+
+/* Unlinks the run @ent[0..n) of bucket @idx, accounting it once */
+static uint32_t
+khash_del_bck(khash_t *kh, uint32_t idx, khash_bulk_t *ent, uint32_t n,
+		khash_reclaim_t *r)
 {
+	khash_filter_t *filter = khash_filter_get(kh);
+	khash_cache_t *cache = khash_cache_get(kh);
+	struct hlist_head *head = khash_bck_get(kh, idx);
 	khash_item_t *item = NULL;
-	void *value = NULL;
+	uint32_t i, removed = 0, nmulti = 0;
+	uint64_t mem = 0;
 
-	if (!khash)
-		goto khash_rementry_fail;
+	for (i = 0; i < n; i++) {
+		ent[i].status = -1;
+		ent[i].item = NULL;
 
-	item = __khash_lookup(khash, hash);
-	if (!item)
-		goto khash_rementry_fail;
+		item = khash_chain_lookup(head, ent[i].hash);
+		if (!item) {
+			ent[i].value = NULL;
+			continue;
+		}
 
-	value = item->value;
+		ent[i].value = kh->vsize ? NULL : item->value;
+		KHASH_DEL(&item->hh);
+		if (unlikely(filter))
+			khash_filter_del(filter, item->hash);
+		if (unlikely(cache))
+			khash_cache_inval(cache, item->hash);
+		mem += khash_item_mem(kh, item);
+
+		if (item->flags & KHASH_ITEM_F_MULTI) {
+			nmulti++;
+			__khash_item_free_rcu(item);
+		} else if (r) {
+			khash_reclaim_item(r, item);
+		} else {
+			__khash_item_free_rcu(item);
+		}
 
-	__khash_rementry(khash, item);
+		ent[i].status = 0;
+		removed++;
+	}
 
-	if (retval)
-		*retval = value;
-	return (0);
+	if (removed)
+		khash_bck_account(kh, idx, ent[0].hash, -(int32_t)removed,
+				-(int64_t)mem, -(int32_t)nmulti);
 
-khash_rementry_fail:
-	if (retval)
-		*retval = NULL;
-	return (-1);
+	return (removed);
 }
-EXPORT_SYMBOL(khash_rementry);
 
 int
-khash_add_item(khash_t *khash, khash_item_t *item)
+khash_del_bulk(khash_t *khash, khash_bulk_t *ent, uint32_t n)
 {
-	khash_item_t *old_item = NULL;
+	khash_reclaim_t *r = NULL;
+	uint32_t i, j;
+	int done = 0;
 
-	if (!khash || !item)
+	if (unlikely(!khash || (!ent && n)))
 		return (-1);
 
-	old_item = __khash_lookup(khash, item->hash);
-	if (old_item)
-		return (-1);
+	/* Values go back to the caller, not to the destructor */
+	r = khash_reclaim_new(khash);
+	if (r)
+		r->dtor = NULL;
 
-	switch (khash->bck_size) {
-	case KHASH_BCK_SIZE_512k:
-		KHASH_ADD(((khash_512k_t *)khash)->ht, &item->hh, item->hash.key);
-		break;
-	case KHASH_BCK_SIZE_1k:
-		KHASH_ADD(((khash_1k_t *)khash)->ht, &item->hh, item->hash.key);
-		break;
-	case KHASH_BCK_SIZE_16:
-	default:
-		KHASH_ADD(((khash_16_t *)khash)->ht, &item->hh, item->hash.key);
-		break;
+	khash_bulk_sort(khash, ent, n);
+
+	for (i = 0; i < n; i = j) {
+		j = khash_bulk_run(ent, i, n);
+		done += khash_del_bck(khash, ent[i].status, &ent[i], j - i, r);
 	}
 
-	khash->ht_count[khash_hash_idx_get(khash, item->hash)]++;
-	khash->count++;
+	if (r && r->items)
+		khash_reclaim_submit(r);
+	else
+		kfree(r);
 
-	return (0);
+	return (done);
+}
+EXPORT_SYMBOL(khash_del_bulk);
+
+/* Unlinks the entries of bucket @idx matching @pred, accounting them once */
+static uint32_t
+khash_remove_bck(khash_t *kh, uint32_t idx, khfunc pred, void *data,
+		khash_reclaim_t *r, uint32_t *seen)
+{
+	khash_filter_t *filter = khash_filter_get(kh);
+	khash_cache_t *cache = khash_cache_get(kh);
+	khash_item_t *item = NULL, *last = NULL;
+	struct hlist_node *tmp = NULL;
+	uint32_t n = 0, nmulti = 0;
+	uint64_t mem = 0;
+
+	KHASH_CHAIN_FOR_EACH_SAFE(item, tmp, khash_bck_get(kh, idx)) {
+		(*seen)++;
+		if (!pred(item->hash, item->value, data))
+			continue;
+
+		KHASH_DEL(&item->hh);
+		if (unlikely(filter))
+			khash_filter_del(filter, item->hash);
+		if (unlikely(cache))
+			khash_cache_inval(cache, item->hash);
+		mem += khash_item_mem(kh, item);
+		last = item;
+		n++;
+
+		if (item->flags & KHASH_ITEM_F_MULTI) {
+			nmulti++;
+			__khash_item_free_rcu(item);
+		} else {
+			khash_reclaim_item(r, item);
+		}
+	}
+
+	if (n)
+		khash_bck_account(kh, idx, last->hash, -(int32_t)n, -(int64_t)mem,
+				-(int32_t)nmulti);
+
+	return (n);
 }
-EXPORT_SYMBOL(khash_add_item);
 
 int
-khash_addentry(khash_t *khash, khash_key_t hash, void *value, gfp_t flags)
+khash_remove_if_next(khash_t *khash, khash_cursor_t *cursor, khfunc pred,
+		void *data, uint32_t budget)
 {
-	khash_item_t *item = NULL;
+	khash_reclaim_t *r = NULL;
+	uint32_t seen = 0;
+	int removed = 0;
 
-	if (unlikely(!khash))
+	if (unlikely(!khash || !cursor || !pred))
 		return (-1);
 
-	item = khash_item_new(hash, value, flags);
-	if (unlikely(!item))
-		return (-1);
+	if (cursor->done)
+		return (0);
 
-	if (khash_add_item(khash, item) < 0) {
-		kfree(item);
+	/* Nothing is removed unless the values can reach the destructor */
+	r = khash_reclaim_new(khash);
+	if (unlikely(!r))
 		return (-1);
+
+	while (seen < budget) {
+		if (cursor->bck >= khash->bck_size) {
+			cursor->done = 1;
+			break;
+		}
+
+		if ((khash->flags & KHASH_F_SPARSE) &&
+				!khash_bck_page_get(khash, cursor->bck)) {
+			cursor->bck = (cursor->bck | KHASH_PAGE_BCK_MASK) + 1;
+			continue;
+		}
+
+		removed += khash_remove_bck(khash, cursor->bck, pred, data, r, &seen);
+		cursor->bck++;
 	}
 
-	return (0);
+	cursor->pos += seen;
+
+	if (r->items)
+		khash_reclaim_submit(r);
+	else
+		kfree(r);
+
+	return (removed);
 }
-EXPORT_SYMBOL(khash_addentry);
+EXPORT_SYMBOL(khash_remove_if_next);
 
 int
-khash_lookup(khash_t *khash, khash_key_t hash, void **retval)
+khash_remove_if(khash_t *khash, khfunc pred, void *data)
 {
-	khash_item_t *item = NULL;
+	khash_cursor_t cursor;
 
-	if (unlikely(!khash))
-		goto khash_lookup_fail;
+	khash_cursor_init(&cursor);
 
-	item = __khash_lookup(khash, hash);
-	if (!item)
-		goto khash_lookup_fail;
+	return (khash_remove_if_next(khash, &cursor, pred, data, UINT_MAX));
+}
+EXPORT_SYMBOL(khash_remove_if);
 
-	if (retval)
-		*retval = (rcu_dereference(item))->value;
+/* Single entry calls against the bulk ones on a 512k buckets table */
+static void
+khash_bulk_bench_run(void)
+{
+	s64 add_single, del_single, add_bulk, del_bulk;
+	khash_bulk_t *ent = NULL;
+	khash_t *kh = NULL;
+	ktime_t start;
+	uint32_t i;
 
-	return (0);
+	if (!bulk_bench)
+		return;
 
-khash_lookup_fail:
-	if (retval)
-		*retval = NULL;
+	ent = kvmalloc_array(bulk_bench, sizeof(khash_bulk_t), GFP_KERNEL);
+	kh = khash_init(KHASH_BCK_SIZE_512k);
+	if (!ent || !kh)
+		goto khash_bulk_bench_out;
 
-	return (-1);
+	start = ktime_get();
+	for (i = 0; i < bulk_bench; i++)
+		khash_addentry(kh, khash_hash_u32(i), NULL, GFP_KERNEL);
+	add_single = ktime_us_delta(ktime_get(), start);
+
+	start = ktime_get();
+	for (i = 0; i < bulk_bench; i++)
+		khash_rementry(kh, khash_hash_u32(i), NULL);
+	del_single = ktime_us_delta(ktime_get(), start);
+
+	memset(ent, 0, bulk_bench * sizeof(khash_bulk_t));
+	for (i = 0; i < bulk_bench; i++)
+		ent[i].hash = khash_hash_u32(i);
+
+	start = ktime_get();
+	khash_add_bulk(kh, ent, bulk_bench, GFP_KERNEL);
+	add_bulk = ktime_us_delta(ktime_get(), start);
+
+	start = ktime_get();
+	khash_del_bulk(kh, ent, bulk_bench);
+	del_bulk = ktime_us_delta(ktime_get(), start);
+
+	printk(KERN_INFO "[%s] %u entries: add %lld us, bulk add %lld us, "
+			"del %lld us, bulk del %lld us\n", KHASH_VERSION_STR, bulk_bench,
+			add_single, add_bulk, del_single, del_bulk);
+
+khash_bulk_bench_out:
+	khash_term(kh);
+	kvfree(ent);
 }
-EXPORT_SYMBOL(khash_lookup);
 
 int
 khash_size(khash_t *khash)
@@ -409,6 +2054,16 @@ khash_size(khash_t *khash)
 }
 EXPORT_SYMBOL(khash_size);
 
+uint32_t
+khash_gen_get(khash_t *khash)
+{
+	if (unlikely(!khash))
+		return (0);
+
+	return (READ_ONCE(khash->gen));
+}
+EXPORT_SYMBOL(khash_gen_get);
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
 #define KHASH_FOREACH(__kh__, __idx__, __item__, __func__, __data__)        \
 	do {                                                                    \
@@ -437,7 +2092,43 @@ khash_bck_size_get(khash_t *kh)
 __always_inline struct hlist_head *
 khash_bck_get(khash_t *kh, uint32_t idx)
 {
-	return (&kh->ht[idx]);
+	khash_bck_page_t *page = NULL;
+
+	if (kh->flags & KHASH_F_SPARSE) {
+		page = khash_bck_page_get(kh, idx);
+		if (!page)
+			return (&khash_empty_bck);
+
+		return (&page->ht[idx & KHASH_PAGE_BCK_MASK]);
+	}
+
+	switch (kh->bck_size) {
+	case KHASH_BCK_SIZE_512k:
+		return (&((khash_bck_512k_t *)kh->bck)->ht[idx]);
+	case KHASH_BCK_SIZE_1k:
+		return (&((khash_bck_1k_t *)kh->bck)->ht[idx]);
+	case KHASH_BCK_SIZE_16:
+	default:
+		return (&((khash_bck_16_t *)kh->bck)->ht[idx]);
+	}
+}
+
+static void
+khash_sparse_foreach(khash_t *kh, khfunc func, void *data)
+{
+	khash_bck_page_t *page = NULL;
+	khash_item_t *item = NULL;
+	uint32_t i, j;
+
+	for (i = 0; i < (kh->bck_size >> KHASH_PAGE_BCK_SHIFT); i++) {
+		page = rcu_dereference_raw(khash_bck_dir(kh)[i]);
+		for (j = 0; page && j < KHASH_PAGE_BCK_SIZE; j++) {
+			KHASH_CHAIN_FOR_EACH(item, &page->ht[j]) {
+				if (func(item->hash, item->value, data))
+					return;
+			}
+		}
+	}
 }
 
 void
@@ -449,21 +2140,105 @@ khash_foreach(khash_t *khash, khfunc func, void *data)
 	if (unlikely(!khash || !func))
 		return;
 
+	if (khash->flags & KHASH_F_SPARSE) {
+		khash_sparse_foreach(khash, func, data);
+		return;
+	}
+
 	switch (khash->bck_size) {
 	case KHASH_BCK_SIZE_512k:
-		KHASH_FOREACH((khash_512k_t *)khash, idx, item, func, data);
+		KHASH_FOREACH((khash_bck_512k_t *)khash->bck, idx, item, func, data);
 		break;
 	case KHASH_BCK_SIZE_1k:
-		KHASH_FOREACH((khash_1k_t *)khash, idx, item, func, data);
+		KHASH_FOREACH((khash_bck_1k_t *)khash->bck, idx, item, func, data);
 		break;
 	case KHASH_BCK_SIZE_16:
 	default:
-		KHASH_FOREACH((khash_16_t *)khash, idx, item, func, data);
+		KHASH_FOREACH((khash_bck_16_t *)khash->bck, idx, item, func, data);
 		break;
 	}
 }
 EXPORT_SYMBOL(khash_foreach);
 
+void
+khash_cursor_init(khash_cursor_t *cursor)
+{
+	if (unlikely(!cursor))
+		return;
+
+	memset(cursor, 0, sizeof(khash_cursor_t));
+}
+EXPORT_SYMBOL(khash_cursor_init);
+
+/*
+ * Visit whole buckets from the cursor position until at least @budget
+ * entries have been handed to @func (or the table ends). A non zero
+ * return of @func terminates the walk. Returns the visited entries.
+ */
+int
+khash_cursor_next(khash_t *khash, khash_cursor_t *cursor, khfunc func,
+		void *data, uint32_t budget)
+{
+	khash_item_t *item = NULL;
+	uint32_t visited = 0;
+
+	if (unlikely(!khash || !cursor || !func))
+		return (-1);
+
+	while (!cursor->done && visited < budget) {
+		if (cursor->bck >= khash->bck_size) {
+			cursor->done = 1;
+			break;
+		}
+
+		if ((khash->flags & KHASH_F_SPARSE) &&
+				!khash_bck_page_get(khash, cursor->bck)) {
+			cursor->bck = (cursor->bck | KHASH_PAGE_BCK_MASK) + 1;
+			continue;
+		}
+
+		KHASH_CHAIN_FOR_EACH(item, khash_bck_get(khash, cursor->bck)) {
+			visited++;
+			if (func(item->hash, item->value, data)) {
+				cursor->done = 1;
+				break;
+			}
+		}
+
+		cursor->bck++;
+	}
+
+	cursor->pos += visited;
+
+	return (visited);
+}
+EXPORT_SYMBOL(khash_cursor_next);
+
+/*
+ * khash_foreach() in chunks of about @chunk entries, leaving the RCU read
+ * side and rescheduling between chunks. The table itself MUST stay alive.
+ */
+void
+khash_foreach_chunked(khash_t *khash, khfunc func, void *data, uint32_t chunk)
+{
+	khash_cursor_t cursor;
+
+	if (unlikely(!khash || !func))
+		return;
+
+	might_sleep();
+
+	khash_cursor_init(&cursor);
+	while (!cursor.done) {
+		rcu_read_lock();
+		khash_cursor_next(khash, &cursor, func, data, chunk ? chunk : 1);
+		rcu_read_unlock();
+
+		cond_resched();
+	}
+}
+EXPORT_SYMBOL(khash_foreach_chunked);
+
 __always_inline static uint64_t
 sqrt_u64(uint64_t a)
 {
@@ -511,7 +2286,7 @@ khash_stats_get(khash_t *khash, khash_stats_t *stats)
 	stats->count = khash->count;
 
 	for (i = 0; i < khash->bck_size; i++) {
-		tmp = khash->ht_count[i];
+		tmp = khash_bck_count_get(khash, i);
 		if (tmp < stats->min) {
 			stats->min = tmp;
 			stats->min_counter = 1;
@@ -560,6 +2335,36 @@ EXPORT_SYMBOL(khash_stats_get);
 int
 khash_init_module(void)
 {
+	int ret;
+
+	khash_item_cache = kmem_cache_create("khash_item", sizeof(khash_item_t),
+			0, 0, NULL);
+	if (!khash_item_cache)
+		return (-ENOMEM);
+
+	khash_wq = alloc_workqueue("khash", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!khash_wq) {
+		kmem_cache_destroy(khash_item_cache);
+		return (-ENOMEM);
+	}
+
+	khash_hash_bench_run();
+	khash_bulk_bench_run();
+
+	ret = khash_ctl_init();
+	if (ret) {
+		rcu_barrier();
+		destroy_workqueue(khash_wq);
+		kmem_cache_destroy(khash_item_cache);
+		return (ret);
+	}
+
+	/* Tables stay usable from kernel and ioctl without the kfuncs */
+	ret = khash_bpf_init();
+	if (ret)
+		printk(KERN_WARNING "[%s] BPF kfuncs not registered (%d)\n",
+				KHASH_VERSION_STR, ret);
+
 	printk(KERN_INFO "[%s] module loaded\n", KHASH_VERSION_STR);
 
 	return 0;
@@ -568,6 +2373,14 @@ khash_init_module(void)
 void
 khash_exit_module(void)
 {
+	khash_bpf_exit();
+	khash_ctl_exit();
+
+	/* Flush the pending reclaim batches before tearing khash_wq down */
+	rcu_barrier();
+	destroy_workqueue(khash_wq);
+	kmem_cache_destroy(khash_item_cache);
+
 	printk(KERN_INFO "[%s] module unloaded\n", KHASH_VERSION_STR);
 }
 
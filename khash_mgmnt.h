@@ -43,35 +43,207 @@ typedef struct {
 	u32 key;
 } khash_key_t;
 
+typedef struct khash_t khash_t;
+
+/* khash_item_t flags */
+#define KHASH_ITEM_F_MULTI  0x0001 /* Index slot of a khash_mitem_t */
+#define KHASH_ITEM_F_INLINE 0x0002 /* Value stored inside the entry */
+#define KHASH_ITEM_F_CACHE  0x0004 /* Allocated from the khash_item cache */
+#define KHASH_ITEM_F_ARENA  0x0008 /* Carved from the table arena */
+#define KHASH_ITEM_F_POOL   0x0010 /* Taken from the table item pool */
+
+/* rcu last: an inline entry keeps its value there, see khash_iitem_t */
 typedef struct {
-	struct rcu_head rcu;
 	struct hlist_node hh;
 	khash_key_t hash;
 	void *value;
+	uint16_t flags;
+	uint16_t idx;
+	struct rcu_head rcu;
 } khash_item_t;
 
-typedef struct khash_t khash_t;
+/*
+ * Multi-index entry: a single allocation linked into up to
+ * KHASH_MITEM_MAX_IDX tables at once, one khash_item_t slot per table.
+ * Removing it from one table only unlinks that slot; the entry is released
+ * with a single RCU free once the last slot has been unlinked.
+ */
+#define KHASH_MITEM_MAX_IDX 4
+
+typedef struct {
+	struct rcu_head rcu;
+	atomic_t linked;
+	uint16_t nidx;
+	khash_t *kh[KHASH_MITEM_MAX_IDX];
+	khash_item_t idx[];
+} khash_mitem_t;
 
 typedef int(*khfunc)(khash_key_t hash, void *value, void *user_data);
 
+/* khash_init_flags() flags */
+#define KHASH_F_HUGE    0x0001 /* Back the bucket array with huge pages */
+#define KHASH_F_SPARSE  0x0002 /* Allocate bucket pages on demand */
+#define KHASH_F_ACCOUNT 0x0004 /* Charge table memory to the memcg */
+
+/* Memory backing the bucket array */
+typedef enum {
+	KHASH_BACKING_VMALLOC = 0,  /* vzalloc(), 4k pages */
+	KHASH_BACKING_VMALLOC_HUGE, /* vmalloc() with PMD mappings */
+	KHASH_BACKING_PAGES,        /* Physically contiguous pages */
+	KHASH_BACKING_SPARSE,       /* Directory of on demand bucket pages */
+	KHASH_BACKING_STATIC,       /* Caller memory, see khash_init_static() */
+} khash_backing_t;
+
+typedef struct {
+	uint64_t bytes;   /* Table header plus (populated) bucket array */
+	uint32_t backing; /* khash_backing_t */
+} khash_footprint_t;
+
 khash_t *khash_init(uint32_t bck_size); /* Requires non atomic context */
+khash_t *khash_init_flags(uint32_t bck_size, uint32_t flags);
 void khash_term(khash_t *khash);
+
+/*
+ * Table placed in caller memory of at least khash_static_size() bytes,
+ * pointer aligned; any context. khash_term() leaves the memory to the
+ * caller, which may reuse it only after a grace period.
+ */
+size_t khash_static_size(uint32_t bck_size);
+khash_t *khash_init_static(void *mem, size_t size, uint32_t bck_size);
+
+/*
+ * Drops every entry, any context. The entries are released in one
+ * deferred batch, but the writer still clears every bucket head:
+ * O(bck_size) rather than O(1) (sparse tables: O(bucket pages)).
+ */
 void khash_flush(khash_t *khash);
 
+/*
+ * Optional destructor for the entries dropped by khash_flush() and
+ * khash_term(): invoked from a worker once they are no more reachable,
+ * its return value is ignored. Multi index entries are not covered.
+ * Requires non atomic context: setting it reserves what khash_term()
+ * needs, entries khash_flush() drops short of memory wait for the next
+ * flush or for khash_term().
+ */
+int khash_dtor_set(khash_t *khash, khfunc dtor, void *data);
+
+/*
+ * Inline value tables: every entry carries @value_size bytes right after
+ * its key instead of a pointer to a separate allocation. khash_lookup()
+ * hands back a pointer to them, valid under rcu_read_lock() but possibly
+ * torn by a concurrent khash_update_inline(); khash_lookup_copy() returns
+ * a consistent copy. Updates MUST NOT race with readers in hardirq.
+ * khash_rementry() and khash_del_bulk() hand back NULL values, the data
+ * being released with the entry: copy it with khash_lookup_copy() first.
+ */
+#define KHASH_INLINE_MAX_SIZE 512
+
+khash_t *khash_init_inline(uint32_t bck_size, uint32_t flags,
+		uint32_t value_size); /* Requires non atomic context */
+int khash_addentry_inline(khash_t *khash, khash_key_t hash, const void *value,
+		gfp_t flags);
+int khash_update_inline(khash_t *khash, khash_key_t hash, const void *value);
+int khash_lookup_copy(khash_t *khash, khash_key_t hash, void *buf);
+
 uint64_t khash_footprint(khash_t *kh);
+int khash_footprint_get(khash_t *kh, khash_footprint_t *fp);
+const char *khash_backing_str(uint32_t backing);
 uint64_t khash_entry_footprint(void);
 
+/* Live memory of a table, in bytes */
+typedef struct {
+	uint64_t total;   /* All of the below */
+	uint64_t bck;     /* Header, bucket array or directory and pages */
+	uint64_t items;   /* Linked entries */
+	uint64_t extra;   /* Filter, cache, sketch, spare arena/pool */
+	uint64_t budget;  /* 0: unlimited */
+} khash_mem_t;
+
+int khash_mem_get(khash_t *khash, khash_mem_t *mem);
+/* Inserts fail once they would bring total above @bytes (0: unlimited) */
+int khash_budget_set(khash_t *khash, uint64_t bytes);
+
 int khash_size(khash_t *khash);
+uint32_t khash_gen_get(khash_t *khash); /* Bumped on insert/remove/update */
 int khash_addentry(khash_t *khash, khash_key_t hash, void *val, gfp_t flags);
 
 khash_item_t *khash_item_new(khash_key_t hash, void *value, gfp_t flags);
 void khash_item_del(khash_item_t *item);
 int khash_add_item(khash_t *khash, khash_item_t *item);
 
+khash_mitem_t *khash_mitem_new(khash_key_t *hash, uint32_t nidx, void *value,
+		gfp_t flags);
+void khash_mitem_del(khash_mitem_t *mitem);
+int khash_add_mitem(khash_t **khash, khash_mitem_t *mitem);
+int khash_addentry_multi(khash_t **khash, khash_key_t *hash, uint32_t nidx,
+		void *value, gfp_t flags);
+int khash_rementry_multi(khash_t *khash, khash_key_t hash, void **retval);
+
 int khash_rementry(khash_t *khash, khash_key_t hash, void **retval);
+/*
+ * Swap the value of a plain entry in place: readers see either value, the
+ * old one is handed back to be released past a grace period.
+ */
+int khash_replace(khash_t *khash, khash_key_t hash, void *value,
+		void **retval);
+
+/*
+ * Batched insert/remove. The batch is sorted in place by bucket, so that
+ * every bucket is visited and accounted once; callers find their entries
+ * back through @tag. khash_bulk_prepare() allocates the entries ahead of
+ * time (e.g. before taking the writer lock), from the table pool or arena
+ * when it has one, in slab batches otherwise; khash_add_bulk() allocates the
+ * missing ones with @flags and frees those it could not link, leaving
+ * their value to the caller. khash_del_bulk() hands the removed values
+ * back and releases all the entries after a single grace period. Both
+ * return the number of entries succeeded, status tells which.
+ */
+typedef struct {
+	khash_key_t hash;
+	void *value;          /* In: add, out: del (inline: data, NULL) */
+	khash_item_t *item;
+	uint32_t tag;         /* Caller owned */
+	int status;           /* Out: 0 or -1 */
+} khash_bulk_t;
+
+int khash_bulk_prepare(khash_t *khash, khash_bulk_t *ent, uint32_t n,
+		gfp_t flags);
+int khash_add_bulk(khash_t *khash, khash_bulk_t *ent, uint32_t n, gfp_t flags);
+int khash_del_bulk(khash_t *khash, khash_bulk_t *ent, uint32_t n);
 int khash_lookup(khash_t *khash, khash_key_t hash, void **retval);
 void khash_foreach(khash_t *khash, khfunc func, void *data);
 
+/*
+ * Resumable walk, see khash_foreach_chunked(). The cursor always consumes
+ * whole buckets: entries present during the whole walk are visited exactly
+ * once, entries added or removed between two chunks at most once.
+ */
+typedef struct {
+	uint32_t bck;  /* Next bucket to visit */
+	uint32_t pos;  /* Entries visited so far */
+	uint8_t done;
+} khash_cursor_t;
+
+void khash_cursor_init(khash_cursor_t *cursor);
+int khash_cursor_next(khash_t *khash, khash_cursor_t *cursor, khfunc func,
+		void *data, uint32_t budget); /* Requires rcu_read_lock() */
+void khash_foreach_chunked(khash_t *khash, khfunc func, void *data,
+		uint32_t chunk); /* Requires non atomic context */
+
+/*
+ * Unlinks every entry @pred returns non zero for, in a single walk. The
+ * removed entries are released after one grace period, their values
+ * handed to the table destructor (if any); multi index slots are freed
+ * as by khash_rementry_multi(). khash_remove_if_next() stops once at
+ * least @budget entries have been examined, over whole buckets, to bound
+ * the time spent per call. Both are writers and return the entries
+ * removed, or -1 (nothing removed).
+ */
+int khash_remove_if(khash_t *khash, khfunc pred, void *data);
+int khash_remove_if_next(khash_t *khash, khash_cursor_t *cursor, khfunc pred,
+		void *data, uint32_t budget);
+
 u32 khash_bck_size_get(khash_t *kh);
 struct hlist_head *khash_bck_get(khash_t *kh, uint32_t idx);
 
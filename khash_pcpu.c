@@ -0,0 +1,432 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
+#include <linux/interrupt.h>
+
+#include "khash.h"
+#include "khash_internal.h"
+
+enum {
+	KHASH_PCPU_ADD = 0,
+	KHASH_PCPU_DEL,
+	KHASH_PCPU_MOVE, /* Delete, then hand the value over to @dst */
+	KHASH_PCPU_LAND, /* Add of a value handed over by MOVE */
+};
+
+typedef struct khash_pcpu_shard_t khash_pcpu_shard_t;
+
+/* Write queued to the owner of a shard */
+typedef struct {
+	struct llist_node node;
+	khash_key_t hash;
+	void *value;
+	khash_pcpu_shard_t *dst;
+	uint8_t op;
+	/* Head of a batch of dropped values, released past a grace period */
+	struct rcu_head rcu;
+	struct work_struct work;
+	khash_pcpu_t *pt;
+} khash_pcpu_req_t;
+
+struct khash_pcpu_shard_t {
+	khash_t *kh;
+	khash_pcpu_t *pt;
+	int cpu;
+	struct llist_head inbox;
+	struct work_struct work;
+};
+
+struct khash_pcpu_t {
+	khfunc dtor;
+	void *data;
+	khash_pcpu_stats_t __percpu *stats;
+	khash_pcpu_shard_t *shard[]; /* By CPU id, NULL if not possible */
+};
+
+__always_inline static khash_pcpu_shard_t *
+khash_pcpu_shard(khash_pcpu_t *pt, uint32_t cpu)
+{
+	if (unlikely(cpu >= nr_cpu_ids))
+		return (NULL);
+
+	return (pt->shard[cpu]);
+}
+
+static void
+khash_pcpu_dispose_work(struct work_struct *work)
+{
+	khash_pcpu_req_t *req = container_of(work, khash_pcpu_req_t, work);
+	khash_pcpu_req_t *tmp = NULL;
+	khash_pcpu_t *pt = req->pt;
+
+	llist_for_each_entry_safe(req, tmp, &req->node, node) {
+		if (pt->dtor)
+			pt->dtor(req->hash, req->value, pt->data);
+		kfree(req);
+	}
+}
+
+static void
+khash_pcpu_dispose_rcu(struct rcu_head *rcu)
+{
+	khash_pcpu_req_t *req = container_of(rcu, khash_pcpu_req_t, rcu);
+
+	INIT_WORK(&req->work, khash_pcpu_dispose_work);
+	queue_work(khash_wq, &req->work);
+}
+
+__always_inline static void
+khash_pcpu_post(khash_pcpu_shard_t *shard, khash_pcpu_req_t *req)
+{
+	if (llist_add(&req->node, &shard->inbox))
+		queue_work_on(shard->cpu, system_highpri_wq, &shard->work);
+}
+
+/* Runs on the owner CPU, BHs off keep it apart from the local writers */
+static void
+khash_pcpu_drain(struct work_struct *work)
+{
+	khash_pcpu_shard_t *shard = container_of(work, khash_pcpu_shard_t, work);
+	khash_pcpu_req_t *req = NULL, *tmp = NULL;
+	struct llist_node *list = NULL, *dispose = NULL;
+
+	list = llist_reverse_order(llist_del_all(&shard->inbox));
+
+	local_bh_disable();
+	llist_for_each_entry_safe(req, tmp, list, node) {
+		switch (req->op) {
+		case KHASH_PCPU_ADD:
+		case KHASH_PCPU_LAND:
+			if (!khash_addentry(shard->kh, req->hash, req->value, GFP_ATOMIC)) {
+				kfree(req);
+				continue;
+			}
+			break;
+		case KHASH_PCPU_MOVE:
+			if (khash_rementry(shard->kh, req->hash, &req->value) < 0) {
+				kfree(req);
+				continue;
+			}
+			/* The value is ours alone now, the request carries it on */
+			req->op = KHASH_PCPU_LAND;
+			khash_pcpu_post(req->dst, req);
+			continue;
+		default:
+			if (khash_rementry(shard->kh, req->hash, &req->value) < 0) {
+				kfree(req);
+				continue;
+			}
+			break;
+		}
+
+		req->node.next = dispose;
+		dispose = &req->node;
+	}
+	local_bh_enable();
+
+	/* The worker is shared: never wait for the grace period in here */
+	if (dispose) {
+		req = llist_entry(dispose, khash_pcpu_req_t, node);
+		req->pt = shard->pt;
+		call_rcu(&req->rcu, khash_pcpu_dispose_rcu);
+	}
+}
+
+static int
+khash_pcpu_queue(khash_pcpu_t *pt, khash_pcpu_shard_t *shard, uint8_t op,
+		khash_key_t hash, void *value, khash_pcpu_shard_t *dst)
+{
+	khash_pcpu_req_t *req = NULL;
+
+	req = kmalloc(sizeof(khash_pcpu_req_t), GFP_ATOMIC);
+	if (unlikely(!req))
+		return (-1);
+
+	req->hash = hash;
+	req->value = value;
+	req->dst = dst;
+	req->op = op;
+
+	this_cpu_inc(pt->stats->remote);
+	khash_pcpu_post(shard, req);
+
+	return (1);
+}
+
+khash_pcpu_t *
+khash_pcpu_init(uint32_t bck_size, uint32_t flags, khfunc dtor, void *data)
+{
+	khash_pcpu_shard_t *shard = NULL;
+	khash_pcpu_t *pt = NULL;
+	int cpu;
+
+	pt = kzalloc(sizeof(khash_pcpu_t) + nr_cpu_ids *
+			sizeof(khash_pcpu_shard_t *), GFP_KERNEL);
+	if (unlikely(!pt))
+		return (NULL);
+
+	pt->dtor = dtor;
+	pt->data = data;
+
+	pt->stats = alloc_percpu(khash_pcpu_stats_t);
+	if (unlikely(!pt->stats))
+		goto khash_pcpu_init_fail;
+
+	for_each_possible_cpu(cpu) {
+		/* Keep every shard on its owner node and its own cache lines */
+		shard = kzalloc_node(sizeof(khash_pcpu_shard_t), GFP_KERNEL,
+				cpu_to_node(cpu));
+		if (unlikely(!shard))
+			goto khash_pcpu_init_fail;
+
+		pt->shard[cpu] = shard;
+
+		shard->pt = pt;
+		shard->cpu = cpu;
+		init_llist_head(&shard->inbox);
+		INIT_WORK(&shard->work, khash_pcpu_drain);
+
+		shard->kh = khash_init_flags(bck_size, flags);
+		if (unlikely(!shard->kh))
+			goto khash_pcpu_init_fail;
+
+		if (khash_dtor_set(shard->kh, dtor, data) < 0)
+			goto khash_pcpu_init_fail;
+	}
+
+	return (pt);
+
+khash_pcpu_init_fail:
+	khash_pcpu_term(pt);
+	return (NULL);
+}
+EXPORT_SYMBOL(khash_pcpu_init);
+
+/* No more writes may be issued, the pending ones are applied first */
+void
+khash_pcpu_term(khash_pcpu_t *pt)
+{
+	khash_pcpu_shard_t *shard = NULL;
+	int cpu;
+
+	if (unlikely(!pt))
+		return;
+
+	/* Twice: a MOVE drained late may still queue its LAND to any shard */
+	for_each_possible_cpu(cpu) {
+		shard = pt->shard[cpu];
+		if (shard && shard->kh)
+			flush_work(&shard->work);
+	}
+	for_each_possible_cpu(cpu) {
+		shard = pt->shard[cpu];
+		if (shard && shard->kh)
+			flush_work(&shard->work);
+	}
+
+	/* The dropped values are released before the destructor goes away */
+	rcu_barrier();
+	flush_workqueue(khash_wq);
+
+	for_each_possible_cpu(cpu) {
+		shard = pt->shard[cpu];
+		if (shard && shard->kh)
+			khash_term(shard->kh);
+	}
+
+	for_each_possible_cpu(cpu)
+		kfree(pt->shard[cpu]);
+
+	free_percpu(pt->stats);
+	kfree(pt);
+}
+EXPORT_SYMBOL(khash_pcpu_term);
+
+int
+khash_pcpu_add(khash_pcpu_t *pt, uint32_t cpu, khash_key_t hash, void *value)
+{
+	khash_pcpu_shard_t *shard = NULL;
+	int ret;
+
+	if (unlikely(!pt))
+		return (-1);
+
+	shard = khash_pcpu_shard(pt, cpu);
+	if (unlikely(!shard))
+		return (-1);
+
+	local_bh_disable();
+	if (shard->cpu == smp_processor_id()) {
+		ret = khash_addentry(shard->kh, hash, value, GFP_ATOMIC);
+		this_cpu_inc(pt->stats->local);
+		local_bh_enable();
+		return (ret);
+	}
+	local_bh_enable();
+
+	return (khash_pcpu_queue(pt, shard, KHASH_PCPU_ADD, hash, value,
+			NULL));
+}
+EXPORT_SYMBOL(khash_pcpu_add);
+
+/* A queued removal returns no value, it goes to the destructor */
+int
+khash_pcpu_del(khash_pcpu_t *pt, uint32_t cpu, khash_key_t hash,
+		void **retval)
+{
+	khash_pcpu_shard_t *shard = NULL;
+	int ret;
+
+	if (retval)
+		*retval = NULL;
+
+	if (unlikely(!pt))
+		return (-1);
+
+	shard = khash_pcpu_shard(pt, cpu);
+	if (unlikely(!shard))
+		return (-1);
+
+	local_bh_disable();
+	if (shard->cpu == smp_processor_id()) {
+		ret = khash_rementry(shard->kh, hash, retval);
+		this_cpu_inc(pt->stats->local);
+		local_bh_enable();
+		return (ret);
+	}
+	local_bh_enable();
+
+	return (khash_pcpu_queue(pt, shard, KHASH_PCPU_DEL, hash, NULL,
+			NULL));
+}
+EXPORT_SYMBOL(khash_pcpu_del);
+
+/*
+ * The flow of @hash is now steered to @cpu. The value is never touched
+ * here: the owner of the shard holding the entry unlinks it and hands
+ * the value over to the shard of @cpu, lookups may miss it in between.
+ */
+int
+khash_pcpu_migrate(khash_pcpu_t *pt, uint32_t cpu, khash_key_t hash)
+{
+	khash_pcpu_shard_t *shard = NULL, *old = NULL;
+	int i;
+
+	if (unlikely(!pt))
+		return (-1);
+
+	shard = khash_pcpu_shard(pt, cpu);
+	if (unlikely(!shard))
+		return (-1);
+
+	rcu_read_lock();
+	for_each_possible_cpu(i) {
+		if (pt->shard[i] != shard &&
+				!khash_lookup(pt->shard[i]->kh, hash, NULL)) {
+			old = pt->shard[i];
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	if (!old)
+		return (-1);
+
+	return (khash_pcpu_queue(pt, old, KHASH_PCPU_MOVE, hash, NULL, shard));
+}
+EXPORT_SYMBOL(khash_pcpu_migrate);
+
+/* Requires rcu_read_lock() */
+int
+khash_pcpu_lookup(khash_pcpu_t *pt, uint32_t cpu, khash_key_t hash,
+		void **retval)
+{
+	khash_pcpu_shard_t *shard = NULL;
+	int i;
+
+	if (retval)
+		*retval = NULL;
+
+	if (unlikely(!pt))
+		return (-1);
+
+	shard = khash_pcpu_shard(pt, cpu);
+	if (likely(shard && !khash_lookup(shard->kh, hash, retval)))
+		return (0);
+
+	for_each_possible_cpu(i) {
+		if (pt->shard[i] == shard)
+			continue;
+
+		if (!khash_lookup(pt->shard[i]->kh, hash, retval)) {
+			this_cpu_inc(pt->stats->cross);
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+EXPORT_SYMBOL(khash_pcpu_lookup);
+
+int
+khash_pcpu_size(khash_pcpu_t *pt)
+{
+	int size = 0, cpu;
+
+	if (unlikely(!pt))
+		return (-1);
+
+	for_each_possible_cpu(cpu)
+		size += khash_size(pt->shard[cpu]->kh);
+
+	return (size);
+}
+EXPORT_SYMBOL(khash_pcpu_size);
+
+int
+khash_pcpu_stats_get(khash_pcpu_t *pt, khash_pcpu_stats_t *stats)
+{
+	khash_pcpu_stats_t *pcpu = NULL;
+	int cpu;
+
+	if (unlikely(!pt || !stats))
+		return (-1);
+
+	memset(stats, 0, sizeof(khash_pcpu_stats_t));
+
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(pt->stats, cpu);
+		stats->local += pcpu->local;
+		stats->remote += pcpu->remote;
+		stats->cross += pcpu->cross;
+	}
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_pcpu_stats_get);
@@ -0,0 +1,66 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KHASH_PCPU_H
+#define KHASH_PCPU_H
+
+/*
+ * Partitioned table: one khash shard per possible CPU. Every call takes
+ * the id of the CPU the flow of the key is steered to, i.e. the CPU the
+ * NIC RSS (or RPS) delivers it to: on the receive path of that flow it
+ * is simply smp_processor_id(). Writes to the shard of the local CPU are
+ * applied in place with no lock but BHs off; writes to another shard are
+ * queued to its owner CPU and applied there asynchronously. Lookups work
+ * from any CPU under rcu_read_lock(): the shard of @cpu first, then
+ * (slow path) all the others.
+ *
+ * Values dropped by queued writes are passed to the destructor from
+ * khash_wq, past a grace period. The shard of an offline CPU is only
+ * written by its queue.
+ */
+
+typedef struct khash_pcpu_t khash_pcpu_t;
+
+typedef struct {
+	uint64_t local;   /* Writes applied in place */
+	uint64_t remote;  /* Writes queued to another CPU */
+	uint64_t cross;   /* Lookups hit outside the steered shard */
+} khash_pcpu_stats_t;
+
+khash_pcpu_t *khash_pcpu_init(uint32_t bck_size, uint32_t flags,
+		khfunc dtor, void *data); /* Requires non atomic context */
+void khash_pcpu_term(khash_pcpu_t *pt); /* Requires non atomic context */
+
+/* 0: applied, 1: queued to the owner CPU, -1: failure */
+int khash_pcpu_add(khash_pcpu_t *pt, uint32_t cpu, khash_key_t hash,
+		void *value);
+int khash_pcpu_del(khash_pcpu_t *pt, uint32_t cpu, khash_key_t hash,
+		void **retval);
+/* Move @hash into the shard of @cpu, always queued (1) */
+int khash_pcpu_migrate(khash_pcpu_t *pt, uint32_t cpu, khash_key_t hash);
+
+int khash_pcpu_lookup(khash_pcpu_t *pt, uint32_t cpu, khash_key_t hash,
+		void **retval);
+int khash_pcpu_size(khash_pcpu_t *pt);
+int khash_pcpu_stats_get(khash_pcpu_t *pt, khash_pcpu_stats_t *stats);
+
+#endif
@@ -0,0 +1,302 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/percpu-refcount.h>
+
+#include "khash.h"
+#include "khash_internal.h"
+
+#define KHASH_POOL_SLOT_SIZE ALIGN(sizeof(khash_item_t), sizeof(void *))
+#define KHASH_POOL_FIRST \
+	ALIGN(sizeof(khash_pool_chunk_t), KHASH_POOL_SLOT_SIZE)
+#define KHASH_POOL_SLOTS \
+	((KHASH_POOL_CHUNK_SIZE - KHASH_POOL_FIRST) / KHASH_POOL_SLOT_SIZE)
+
+__always_inline static khash_pool_t *
+khash_pool_of(const void *slot)
+{
+	return (((khash_pool_chunk_t *)((unsigned long)slot &
+			~(KHASH_POOL_CHUNK_SIZE - 1)))->pool);
+}
+
+/* A zeroed (never initialized) reference is fine with percpu_ref_exit() */
+static void
+khash_pool_free(khash_pool_t *p)
+{
+	khash_pool_chunk_t *c = NULL, *next = NULL;
+
+	percpu_ref_exit(&p->ref);
+
+	for (c = p->chunks; c; c = next) {
+		next = c->next;
+		free_pages((unsigned long)c, KHASH_POOL_ORDER);
+	}
+
+	free_percpu(p->mag);
+	kfree(p);
+}
+
+static void
+khash_pool_release_work(struct work_struct *work)
+{
+	khash_pool_t *p = container_of(work, khash_pool_t, work);
+
+	khash_pool_free(p);
+}
+
+/* The last slot is back: khash_wq is drained by the module exit */
+static void
+khash_pool_release(struct percpu_ref *ref)
+{
+	khash_pool_t *p = container_of(ref, khash_pool_t, ref);
+
+	INIT_WORK(&p->work, khash_pool_release_work);
+	queue_work(khash_wq, &p->work);
+}
+
+/* Drops the table reference, any context */
+void
+khash_pool_put(khash_pool_t *p)
+{
+	if (p)
+		percpu_ref_kill(&p->ref);
+}
+
+/* Depot side, @mag locked with IRQs off */
+static void
+khash_pool_refill(khash_pool_t *p, khash_pool_mag_t *mag)
+{
+	void *slot = NULL;
+
+	spin_lock(&p->lock);
+	while (p->depot && mag->n < KHASH_POOL_MAG / 2) {
+		slot = p->depot;
+		p->depot = *(void **)slot;
+		p->ndepot--;
+		mag->slot[mag->n++] = slot;
+	}
+	spin_unlock(&p->lock);
+}
+
+static void
+khash_pool_drain(khash_pool_t *p, khash_pool_mag_t *mag)
+{
+	void *slot = NULL;
+
+	spin_lock(&p->lock);
+	while (mag->n > KHASH_POOL_MAG / 2) {
+		slot = mag->slot[--mag->n];
+		*(void **)slot = p->depot;
+		p->depot = slot;
+		p->ndepot++;
+	}
+	spin_unlock(&p->lock);
+}
+
+/* Depot empty: the slots left sit in the other magazines */
+static void *
+khash_pool_steal(khash_pool_t *p)
+{
+	khash_pool_mag_t *mag = NULL;
+	void *slot = NULL;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(p->mag, cpu);
+		if (!READ_ONCE(mag->n))
+			continue;
+
+		spin_lock(&mag->lock);
+		if (mag->n)
+			slot = mag->slot[--mag->n];
+		spin_unlock(&mag->lock);
+
+		if (slot)
+			break;
+	}
+
+	return (slot);
+}
+
+khash_item_t *
+khash_pool_item_new(khash_pool_t *p, khash_key_t hash, void *value)
+{
+	khash_pool_mag_t *mag = NULL;
+	khash_item_t *item = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	mag = this_cpu_ptr(p->mag);
+	spin_lock(&mag->lock);
+	if (!mag->n)
+		khash_pool_refill(p, mag);
+	if (mag->n)
+		item = mag->slot[--mag->n];
+	spin_unlock(&mag->lock);
+
+	if (unlikely(!item))
+		item = khash_pool_steal(p);
+	local_irq_restore(flags);
+
+	if (unlikely(!item))
+		return (NULL);
+
+	percpu_ref_get(&p->ref);
+
+	memset(item, 0, sizeof(khash_item_t));
+	item->hash = hash;
+	item->value = value;
+	item->flags = KHASH_ITEM_F_POOL;
+
+	return (item);
+}
+
+/* Nobody can reach @item anymore, any context */
+void
+khash_pool_item_free(khash_item_t *item)
+{
+	khash_pool_t *p = khash_pool_of(item);
+	khash_pool_mag_t *mag = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	mag = this_cpu_ptr(p->mag);
+	spin_lock(&mag->lock);
+	if (mag->n == KHASH_POOL_MAG)
+		khash_pool_drain(p, mag);
+	mag->slot[mag->n++] = item;
+	spin_unlock(&mag->lock);
+	local_irq_restore(flags);
+
+	percpu_ref_put(&p->ref);
+}
+
+void
+khash_pool_item_free_rcu(struct rcu_head *rcu)
+{
+	khash_pool_item_free(container_of(rcu, khash_item_t, rcu));
+}
+
+int
+khash_pool_enable(khash_t *khash, uint32_t capacity)
+{
+	khash_pool_chunk_t *c = NULL;
+	khash_pool_t *p = NULL;
+	uint32_t i, n;
+	void *slot = NULL;
+	int cpu;
+
+	if (unlikely(!khash || !capacity || khash->vsize || khash->pool))
+		return (-1);
+
+	might_sleep();
+
+	p = kzalloc(sizeof(khash_pool_t), khash_gfp(khash, GFP_KERNEL));
+	if (unlikely(!p))
+		return (-1);
+
+	spin_lock_init(&p->lock);
+
+	p->mag = alloc_percpu(khash_pool_mag_t);
+	if (unlikely(!p->mag))
+		goto khash_pool_enable_fail;
+
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(p->mag, cpu)->lock);
+
+	if (percpu_ref_init(&p->ref, khash_pool_release, 0, GFP_KERNEL))
+		goto khash_pool_enable_fail;
+
+	while (p->capacity < capacity) {
+		c = (khash_pool_chunk_t *)__get_free_pages(khash_gfp(khash, GFP_KERNEL),
+				KHASH_POOL_ORDER);
+		if (unlikely(!c))
+			goto khash_pool_enable_fail;
+
+		c->pool = p;
+		c->next = p->chunks;
+		p->chunks = c;
+		p->nchunks++;
+
+		n = min_t(uint32_t, capacity - p->capacity, KHASH_POOL_SLOTS);
+		for (i = 0; i < n; i++) {
+			slot = (uint8_t *)c + KHASH_POOL_FIRST + i * KHASH_POOL_SLOT_SIZE;
+			*(void **)slot = p->depot;
+			p->depot = slot;
+		}
+		p->ndepot += n;
+		p->capacity += n;
+	}
+
+	khash->pool = p;
+
+	return (0);
+
+khash_pool_enable_fail:
+	khash_pool_free(p);
+	return (-1);
+}
+EXPORT_SYMBOL(khash_pool_enable);
+
+/* Lockless, approximate while the table is written */
+static uint32_t
+khash_pool_free_count(khash_pool_t *p)
+{
+	uint32_t n = READ_ONCE(p->ndepot);
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		n += READ_ONCE(per_cpu_ptr(p->mag, cpu)->n);
+
+	return (min(n, p->capacity));
+}
+
+/* Chunk memory not holding a live entry */
+uint64_t
+khash_pool_mem(khash_pool_t *p)
+{
+	return (p ? sizeof(*p) + num_possible_cpus() * sizeof(khash_pool_mag_t) +
+			(uint64_t)p->nchunks * KHASH_POOL_CHUNK_SIZE -
+			(uint64_t)(p->capacity - khash_pool_free_count(p)) *
+			sizeof(khash_item_t) : 0);
+}
+
+int
+khash_pool_stats_get(khash_t *khash, khash_pool_stats_t *stats)
+{
+	if (unlikely(!khash || !stats || !khash->pool))
+		return (-1);
+
+	stats->capacity = khash->pool->capacity;
+	stats->free = khash_pool_free_count(khash->pool);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_pool_stats_get);
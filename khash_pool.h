@@ -0,0 +1,49 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KHASH_POOL_H
+#define KHASH_POOL_H
+
+/*
+ * Preallocated entries: once a table owns a pool, khash_addentry() and
+ * khash_bulk_prepare() (so khash_add_bulk(), the control device ADD and
+ * khash_restore()) take their entries from @capacity slots allocated
+ * upfront, through per-CPU magazines, and never call the page allocator.
+ * Those inserts, from any context (hardirq included), then only fail for
+ * memory once every slot is linked or waiting for its grace period.
+ * khash_add_item() and khash_add_mitem() link entries the caller
+ * allocated, the pool does not cover them; sparse tables still allocate
+ * their bucket pages.
+ *
+ * Enabling requires non atomic context and MUST be serialized with the
+ * table writers; the pool lives until khash_term().
+ */
+
+typedef struct {
+	uint32_t capacity;
+	uint32_t free;     /* Slots ready to be handed out */
+} khash_pool_stats_t;
+
+int khash_pool_enable(khash_t *khash, uint32_t capacity);
+int khash_pool_stats_get(khash_t *khash, khash_pool_stats_t *stats);
+
+#endif
@@ -0,0 +1,304 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+
+#include "khash.h"
+#include "khash_internal.h"
+
+#define KHASH_SERIAL_BUF (64 * 1024)
+/* Records linked per khash_add_bulk() round on restore */
+#define KHASH_SERIAL_BULK 256
+
+__always_inline static uint32_t
+khash_serial_seed(khash_t *kh)
+{
+	return (kh->hops ? kh->hseed : JHASH_INITVAL);
+}
+
+/* Room for @vmax value bytes MUST follow @buf; returns the record size */
+static int
+khash_serial_rec_put(khash_t *kh, khash_item_t *item, uint8_t *buf,
+		khash_value_enc_t enc, uint32_t vmax, void *ctx)
+{
+	khash_serial_rec_t *rec = (khash_serial_rec_t *)buf;
+	uint8_t *vbuf = buf + sizeof(khash_serial_rec_t);
+	khash_iitem_t *iitem = NULL;
+	unsigned int seq;
+	int vlen = 0;
+
+	if (kh->vsize) {
+		iitem = khash_iitem_get(item);
+		do {
+			seq = read_seqcount_begin(&iitem->seq);
+			memcpy(vbuf, iitem->data, kh->vsize);
+		} while (read_seqcount_retry(&iitem->seq, seq));
+		vlen = kh->vsize;
+	} else if (enc) {
+		vlen = enc(item->hash, item->value, vbuf, vmax, ctx);
+		if (vlen < 0 || vlen > vmax)
+			return (-1);
+	}
+
+	rec->key = item->hash.__key._64;
+	rec->hash = item->hash.key;
+	rec->vlen = vlen;
+	memset(vbuf + vlen, 0, ALIGN(vlen, 8) - vlen);
+
+	return (sizeof(khash_serial_rec_t) + ALIGN(vlen, 8));
+}
+
+int
+khash_serialize(khash_t *khash, khash_serial_write_t write,
+		khash_value_enc_t enc, uint32_t vmax, void *ctx)
+{
+	khash_serial_rec_t eos = {};
+	khash_serial_hdr_t hdr = {};
+	uint32_t cap, len = 0, start, rec_max, count = 0, b, n;
+	khash_item_t *item = NULL;
+	uint8_t *buf = NULL, *tmp = NULL;
+	int ret;
+
+	if (unlikely(!khash || !write))
+		return (-1);
+
+	might_sleep();
+
+	if (khash->vsize)
+		vmax = khash->vsize;
+	else if (!enc)
+		vmax = 0;
+	if (vmax > KHASH_SERIAL_VMAX)
+		return (-1);
+
+	rec_max = sizeof(khash_serial_rec_t) + ALIGN(vmax, 8);
+	cap = max_t(uint32_t, KHASH_SERIAL_BUF, rec_max);
+
+	buf = kvmalloc(cap, GFP_KERNEL);
+	if (unlikely(!buf))
+		return (-1);
+
+	hdr.magic = KHASH_SERIAL_MAGIC;
+	hdr.version = KHASH_SERIAL_VERSION;
+	hdr.hdr_size = sizeof(khash_serial_hdr_t);
+	hdr.flags = khash->flags;
+	hdr.bck_size = khash->bck_size;
+	hdr.vsize = khash->vsize;
+	hdr.hseed = khash_serial_seed(khash);
+	strscpy(hdr.hops, khash_hash_ops_get(khash)->name, sizeof(hdr.hops));
+
+	if (write(&hdr, sizeof(hdr), ctx))
+		goto khash_serialize_fail;
+
+	for (b = 0; b < khash->bck_size; b++) {
+khash_serialize_retry:
+		/* One walk per bucket: no entry linked throughout it is missed */
+		start = len;
+		n = 0;
+		rcu_read_lock();
+		KHASH_CHAIN_FOR_EACH(item, khash_bck_get(khash, b)) {
+			if (len + rec_max > cap)
+				break;
+
+			ret = khash_serial_rec_put(khash, item, buf + len, enc, vmax, ctx);
+			if (ret < 0) {
+				rcu_read_unlock();
+				goto khash_serialize_fail;
+			}
+			len += ret;
+			n++;
+		}
+		rcu_read_unlock();
+
+		/* Out of room: drop the partial bucket, make room, walk it again */
+		if (item) {
+			len = start;
+			if (len) {
+				if (write(buf, len, ctx))
+					goto khash_serialize_fail;
+				len = 0;
+			} else {
+				/* A chain longer than the whole buffer */
+				tmp = kvmalloc(cap * 2, GFP_KERNEL);
+				if (unlikely(!tmp))
+					goto khash_serialize_fail;
+				kvfree(buf);
+				buf = tmp;
+				cap *= 2;
+			}
+			goto khash_serialize_retry;
+		}
+		count += n;
+
+		if (!(b & 1023))
+			cond_resched();
+	}
+
+	if (len && write(buf, len, ctx))
+		goto khash_serialize_fail;
+
+	eos.key = count;
+	eos.vlen = KHASH_SERIAL_EOS;
+	if (write(&eos, sizeof(eos), ctx))
+		goto khash_serialize_fail;
+
+	kvfree(buf);
+	return (count);
+
+khash_serialize_fail:
+	kvfree(buf);
+	return (-1);
+}
+EXPORT_SYMBOL(khash_serialize);
+
+static int
+khash_restore_hdr(khash_t *kh, khash_serial_read_t read, void *ctx)
+{
+	khash_serial_hdr_t hdr = {};
+	uint8_t skip[64];
+	uint32_t left, n;
+
+	if (read(&hdr, sizeof(hdr), ctx))
+		return (-1);
+
+	if (hdr.magic != KHASH_SERIAL_MAGIC || hdr.version > KHASH_SERIAL_VERSION ||
+			hdr.hdr_size < sizeof(hdr))
+		return (-1);
+
+	if (hdr.vsize != kh->vsize || hdr.hseed != khash_serial_seed(kh) ||
+			strncmp(hdr.hops, khash_hash_ops_get(kh)->name, sizeof(hdr.hops)))
+		return (-1);
+
+	/* Fields of later versions */
+	for (left = hdr.hdr_size - sizeof(hdr); left; left -= n) {
+		n = min_t(uint32_t, left, sizeof(skip));
+		if (read(skip, n, ctx))
+			return (-1);
+	}
+
+	return (0);
+}
+
+/* Link the pending records, the values not linked go to the destructor */
+static int
+khash_restore_flush(khash_t *kh, khash_bulk_t *ent, uint32_t n)
+{
+	uint32_t i;
+	int done;
+
+	done = khash_add_bulk(kh, ent, n, GFP_KERNEL);
+
+	for (i = 0; !kh->vsize && i < n; i++) {
+		if (ent[i].status && ent[i].value && kh->dtor)
+			kh->dtor(ent[i].hash, ent[i].value, kh->dtor_data);
+	}
+
+	cond_resched();
+
+	return (done);
+}
+
+int
+khash_restore(khash_t *khash, khash_serial_read_t read, khash_value_dec_t dec,
+		void *ctx)
+{
+	khash_serial_rec_t rec = {};
+	khash_bulk_t *ent = NULL;
+	uint8_t *vbuf = NULL;
+	uint32_t n = 0, vstride;
+	int count = 0;
+
+	if (unlikely(!khash || !read))
+		return (-1);
+
+	/* Decoded values not linked need an owner, or they would leak */
+	if (!khash->vsize && dec && !khash->dtor)
+		return (-1);
+
+	might_sleep();
+
+	if (khash_restore_hdr(khash, read, ctx) < 0)
+		return (-1);
+
+	/* Inline values stay in vbuf until their batch is linked */
+	vstride = khash->vsize ? ALIGN(khash->vsize, 8) : 0;
+
+	ent = kvmalloc_array(KHASH_SERIAL_BULK, sizeof(khash_bulk_t), GFP_KERNEL);
+	vbuf = kvmalloc(max_t(uint32_t, KHASH_SERIAL_VMAX,
+			KHASH_SERIAL_BULK * vstride), GFP_KERNEL);
+	if (unlikely(!ent || !vbuf))
+		goto khash_restore_fail;
+
+	while (1) {
+		if (read(&rec, sizeof(rec), ctx))
+			goto khash_restore_fail;
+
+		if (rec.vlen == KHASH_SERIAL_EOS)
+			break;
+
+		if (rec.vlen > KHASH_SERIAL_VMAX ||
+				(khash->vsize && rec.vlen != khash->vsize))
+			goto khash_restore_fail;
+
+		if (rec.vlen && read(vbuf + n * vstride, ALIGN(rec.vlen, 8), ctx))
+			goto khash_restore_fail;
+
+		memset(&ent[n], 0, sizeof(khash_bulk_t));
+		ent[n].hash.__key._64 = rec.key;
+		ent[n].hash.key = rec.hash;
+		if (khash->vsize) {
+			ent[n].value = vbuf + n * vstride;
+		} else if (dec) {
+			ent[n].value = dec(ent[n].hash, vbuf, rec.vlen, ctx);
+			if (!ent[n].value)
+				goto khash_restore_fail;
+		}
+
+		if (++n < KHASH_SERIAL_BULK)
+			continue;
+
+		count += khash_restore_flush(khash, ent, n);
+		n = 0;
+	}
+
+	if (n)
+		count += khash_restore_flush(khash, ent, n);
+
+	kvfree(vbuf);
+	kvfree(ent);
+	return (count);
+
+khash_restore_fail:
+	/* Values decoded but not linked yet */
+	while (n--) {
+		if (!khash->vsize && ent[n].value && khash->dtor)
+			khash->dtor(ent[n].hash, ent[n].value, khash->dtor_data);
+	}
+	kvfree(vbuf);
+	kvfree(ent);
+	return (-1);
+}
+EXPORT_SYMBOL(khash_restore);
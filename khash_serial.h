@@ -0,0 +1,88 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KHASH_SERIAL_H
+#define KHASH_SERIAL_H
+
+/*
+ * Table stream, meant to hand a table over across a module reload or a
+ * kexec: a khash_serial_hdr, one khash_serial_rec per entry each followed
+ * by its vlen value bytes (padded to 8), and a closing record with vlen
+ * KHASH_SERIAL_EOS carrying the record count in key.
+ *
+ * Values go through the caller codec: enc() writes at most @size bytes
+ * and returns how many (or < 0 to abort), it runs under rcu_read_lock();
+ * dec() builds a value back from them, NULL is a decode error that aborts
+ * the restore. Inline value tables need no codec. Without enc() only keys
+ * are saved, and dec() == NULL restores NULL values. Keys keep their
+ * hash, so the target table has to use the same hash ops (checked by
+ * name) and seed.
+ */
+#define KHASH_SERIAL_MAGIC   0x4b485352 /* "KHSR" */
+#define KHASH_SERIAL_VERSION 1
+#define KHASH_SERIAL_EOS     0xffffffff
+#define KHASH_SERIAL_VMAX    (64 * 1024)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t hdr_size;
+	uint32_t flags;     /* khash_init_flags() flags of the source */
+	uint32_t bck_size;
+	uint32_t vsize;     /* Inline value size, 0 for pointer tables */
+	uint32_t hseed;
+	uint32_t pad;
+	char     hops[16];  /* Hash ops name */
+} khash_serial_hdr_t;
+
+typedef struct {
+	uint64_t key;       /* khash_key_t.__key._64 */
+	uint32_t hash;      /* khash_key_t.key */
+	uint32_t vlen;
+} khash_serial_rec_t;
+
+/* Return 0 once all of @len bytes have been consumed/produced */
+typedef int (*khash_serial_write_t)(const void *buf, uint32_t len, void *ctx);
+typedef int (*khash_serial_read_t)(void *buf, uint32_t len, void *ctx);
+
+typedef int (*khash_value_enc_t)(khash_key_t hash, void *value, void *buf,
+		uint32_t size, void *ctx);
+typedef void *(*khash_value_dec_t)(khash_key_t hash, const void *buf,
+		uint32_t len, void *ctx);
+
+/*
+ * Both require non atomic context. Serializing runs beside live writers:
+ * each bucket is captured in a single RCU walk, so every entry linked
+ * throughout it is saved, while concurrent additions and removals may or
+ * may not be. A bucket walked again for room runs enc() again on its
+ * entries. Restoring is a table writer and has to be serialized with the
+ * others, it links records by khash_add_bulk() batches. A decoded value
+ * which cannot be linked, or is pending when the restore fails, is handed
+ * to the table destructor: with dec() the table MUST have one
+ * (khash_dtor_set()), or the restore fails upfront.
+ */
+int khash_serialize(khash_t *khash, khash_serial_write_t write,
+		khash_value_enc_t enc, uint32_t vmax, void *ctx);
+int khash_restore(khash_t *khash, khash_serial_read_t read,
+		khash_value_dec_t dec, void *ctx);
+
+#endif
@@ -0,0 +1,242 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/sort.h>
+
+#include "khash.h"
+#include "khash_internal.h"
+
+/* Serializes the publication of the sketches */
+static DEFINE_MUTEX(khash_sketch_lock);
+
+void
+khash_sketch_free(khash_sketch_t *s)
+{
+	if (!s)
+		return;
+
+	free_percpu(s->pcpu);
+	kfree(s);
+}
+
+static void
+khash_sketch_free_rcu(struct rcu_head *rcu)
+{
+	khash_sketch_free(container_of(rcu, khash_sketch_t, rcu));
+}
+
+/* Space-saving: an unknown key evicts the smallest one, inheriting its count */
+static void
+khash_sketch_update(khash_sketch_ent_t *ent, uint32_t *n, khash_key_t hash)
+{
+	khash_sketch_ent_t *min = NULL;
+	uint32_t i;
+
+	for (i = 0; i < *n; i++) {
+		if (khash_key_match(&ent[i].hash, &hash)) {
+			ent[i].count++;
+			return;
+		}
+
+		if (!min || ent[i].count < min->count)
+			min = &ent[i];
+	}
+
+	if (*n < KHASH_SKETCH_TOPK) {
+		min = &ent[(*n)++];
+		min->count = 0;
+	}
+
+	min->hash = hash;
+	min->err = min->count;
+	min->count++;
+}
+
+void
+khash_sketch_record(khash_sketch_t *s, khash_key_t hash, uint32_t idx)
+{
+	khash_sketch_pcpu_t *pcpu = get_cpu_ptr(s->pcpu);
+	khash_key_t bck = {};
+
+	if (cmpxchg_local(&pcpu->busy, 0, 1) == 0) {
+		bck.key = idx;
+		khash_sketch_update(pcpu->key, &pcpu->nkey, hash);
+		khash_sketch_update(pcpu->bck, &pcpu->nbck, bck);
+		barrier();
+		WRITE_ONCE(pcpu->busy, 0);
+	}
+
+	put_cpu_ptr(s->pcpu);
+}
+
+/* Swaps in @s, the old sketch goes after a grace period */
+void
+khash_sketch_swap(khash_t *kh, khash_sketch_t *s)
+{
+	khash_sketch_t *old = khash_sketch_get(kh);
+
+	rcu_assign_pointer(kh->sketch, s);
+	if (old)
+		call_rcu(&old->rcu, khash_sketch_free_rcu);
+}
+
+int
+khash_sketch_enable(khash_t *khash, uint32_t rate_shift)
+{
+	khash_sketch_t *s = NULL;
+
+	if (unlikely(!khash || rate_shift > KHASH_SKETCH_MAX_SHIFT))
+		return (-1);
+
+	might_sleep();
+
+	s = kzalloc(sizeof(khash_sketch_t), GFP_KERNEL);
+	if (unlikely(!s))
+		return (-1);
+
+	s->shift = rate_shift;
+	s->mask = (1U << rate_shift) - 1;
+
+	s->pcpu = alloc_percpu(khash_sketch_pcpu_t);
+	if (unlikely(!s->pcpu)) {
+		kfree(s);
+		return (-1);
+	}
+
+	mutex_lock(&khash_sketch_lock);
+	khash_sketch_swap(khash, s);
+	mutex_unlock(&khash_sketch_lock);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_sketch_enable);
+
+void
+khash_sketch_disable(khash_t *khash)
+{
+	if (unlikely(!khash))
+		return;
+
+	might_sleep();
+
+	mutex_lock(&khash_sketch_lock);
+	khash_sketch_swap(khash, NULL);
+	mutex_unlock(&khash_sketch_lock);
+}
+EXPORT_SYMBOL(khash_sketch_disable);
+
+static int
+khash_sketch_key_cmp(const void *a, const void *b)
+{
+	const khash_sketch_ent_t *ea = a, *eb = b;
+
+	if (ea->hash.key != eb->hash.key)
+		return (ea->hash.key < eb->hash.key ? -1 : 1);
+
+	if (ea->hash.__key._64 != eb->hash.__key._64)
+		return (ea->hash.__key._64 < eb->hash.__key._64 ? -1 : 1);
+
+	return (0);
+}
+
+static int
+khash_sketch_count_cmp(const void *a, const void *b)
+{
+	const khash_sketch_ent_t *ea = a, *eb = b;
+
+	if (ea->count != eb->count)
+		return (ea->count > eb->count ? -1 : 1);
+
+	return (0);
+}
+
+/*
+ * The per-CPU lists are read racily and merged: a key seen on several
+ * CPUs sums its counts (and error bounds).
+ */
+int
+khash_sketch_top_get(khash_t *khash, int bck, khash_sketch_ent_t *top,
+		uint32_t n)
+{
+	khash_sketch_pcpu_t *pcpu = NULL;
+	khash_sketch_ent_t *all = NULL;
+	khash_sketch_t *s = NULL;
+	uint32_t i, j, m = 0, cnt;
+	int cpu;
+
+	if (unlikely(!khash || !top))
+		return (-1);
+
+	might_sleep();
+
+	all = kvmalloc_array(num_possible_cpus() * KHASH_SKETCH_TOPK,
+			sizeof(khash_sketch_ent_t), GFP_KERNEL);
+	if (unlikely(!all))
+		return (-1);
+
+	rcu_read_lock();
+	s = rcu_dereference(khash->sketch);
+	if (!s) {
+		rcu_read_unlock();
+		kvfree(all);
+		return (-1);
+	}
+
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(s->pcpu, cpu);
+		cnt = min_t(uint32_t, bck ? READ_ONCE(pcpu->nbck) :
+				READ_ONCE(pcpu->nkey), KHASH_SKETCH_TOPK);
+		for (i = 0; i < cnt; i++) {
+			all[m] = bck ? pcpu->bck[i] : pcpu->key[i];
+			all[m].count <<= s->shift;
+			all[m].err <<= s->shift;
+			m++;
+		}
+	}
+	rcu_read_unlock();
+
+	sort(all, m, sizeof(khash_sketch_ent_t), khash_sketch_key_cmp, NULL);
+
+	for (i = 0, j = 0; i < m; i++) {
+		if (j && !khash_sketch_key_cmp(&all[j - 1], &all[i])) {
+			all[j - 1].count += all[i].count;
+			all[j - 1].err += all[i].err;
+			continue;
+		}
+		all[j++] = all[i];
+	}
+
+	sort(all, j, sizeof(khash_sketch_ent_t), khash_sketch_count_cmp, NULL);
+
+	n = min(n, j);
+	memcpy(top, all, n * sizeof(khash_sketch_ent_t));
+	kvfree(all);
+
+	return (n);
+}
+EXPORT_SYMBOL(khash_sketch_top_get);
@@ -0,0 +1,50 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KHASH_SKETCH_H
+#define KHASH_SKETCH_H
+
+/*
+ * Optional sampled heavy hitter sketch on the khash_lookup() path: one
+ * lookup in 2^@rate_shift per CPU feeds a space-saving top-K of the keys
+ * and another one of the buckets, so that an elephant flow or an attack
+ * hammering a chain can be told apart. Enabling again restarts the counts.
+ *
+ * Enable/disable require non atomic context; they can run along readers
+ * and writers, not along khash_term().
+ */
+#define KHASH_SKETCH_TOPK      16
+#define KHASH_SKETCH_MAX_SHIFT 16
+
+typedef struct {
+	khash_key_t hash;  /* Buckets: bucket index in hash.key */
+	uint64_t    count; /* Estimated lookups, sampled ones scaled up */
+	uint64_t    err;   /* count exceeds the truth by at most err */
+} khash_sketch_ent_t;
+
+int khash_sketch_enable(khash_t *khash, uint32_t rate_shift);
+void khash_sketch_disable(khash_t *khash);
+/* Hottest first, returns the entries filled; requires non atomic context */
+int khash_sketch_top_get(khash_t *khash, int bck, khash_sketch_ent_t *top,
+		uint32_t n);
+
+#endif
@@ -0,0 +1,478 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/sort.h>
+
+#include "khash.h"
+#include "khash_internal.h"
+
+typedef struct {
+	struct rcu_head rcu;
+	uint32_t priority;
+	void *value;
+} khash_tss_rule_t;
+
+typedef struct {
+	struct rcu_head rcu;
+	khash_t *kh;
+	uint64_t mask;
+	uint32_t max_prio;  /* Read side bound, never below prio */
+	uint32_t prio;      /* Writer side bound, sets the probing order */
+	uint32_t count;
+	uint64_t hits_last;
+	uint64_t hits_rate;
+	uint64_t __percpu *hits;
+} khash_tss_subt_t;
+
+/* Subtables in probing order: prio descending, then hit rate */
+typedef struct {
+	struct rcu_head rcu;
+	uint32_t n;
+	khash_tss_subt_t *subt[];
+} khash_tss_vec_t;
+
+struct khash_tss_t {
+	uint32_t bck_size;
+	uint32_t count;
+	khash_tss_vec_t __rcu *vec;
+};
+
+__always_inline static khash_key_t
+khash_tss_key(khash_key_t key, uint64_t mask)
+{
+	khash_key_t hash = {};
+
+	hash.__key._64 = key.__key._64 & mask;
+	hash.key = hash_64(hash.__key._64, 32);
+
+	return (hash);
+}
+
+__always_inline static khash_tss_vec_t *
+khash_tss_vec_get(khash_tss_t *tss)
+{
+	return (rcu_dereference_raw(tss->vec));
+}
+
+static int
+khash_tss_subt_cmp(const void *a, const void *b)
+{
+	const khash_tss_subt_t *sa = *(const khash_tss_subt_t **)a;
+	const khash_tss_subt_t *sb = *(const khash_tss_subt_t **)b;
+
+	if (sa->prio != sb->prio)
+		return (sa->prio > sb->prio ? -1 : 1);
+
+	if (sa->hits_rate != sb->hits_rate)
+		return (sa->hits_rate > sb->hits_rate ? -1 : 1);
+
+	return (0);
+}
+
+/*
+ * Publish a new probing order made of the current subtables, minus @del
+ * and plus @add. Readers keep walking the old vector until a grace period.
+ */
+static int
+khash_tss_vec_update(khash_tss_t *tss, khash_tss_subt_t *add,
+		khash_tss_subt_t *del, gfp_t flags)
+{
+	khash_tss_vec_t *old = khash_tss_vec_get(tss);
+	khash_tss_vec_t *vec = NULL;
+	uint32_t i, n = 0;
+
+	vec = kzalloc(sizeof(khash_tss_vec_t) + ((old ? old->n : 0) + 1) *
+			sizeof(khash_tss_subt_t *), flags);
+	if (unlikely(!vec))
+		return (-1);
+
+	for (i = 0; old && i < old->n; i++) {
+		if (old->subt[i] != del)
+			vec->subt[n++] = old->subt[i];
+	}
+
+	if (add)
+		vec->subt[n++] = add;
+
+	vec->n = n;
+	sort(vec->subt, n, sizeof(khash_tss_subt_t *), khash_tss_subt_cmp, NULL);
+
+	rcu_assign_pointer(tss->vec, vec);
+	if (old)
+		kfree_rcu(old, rcu);
+
+	return (0);
+}
+
+static khash_tss_subt_t *
+khash_tss_subt_new(khash_tss_t *tss, uint64_t mask)
+{
+	khash_tss_subt_t *subt = NULL;
+
+	subt = kzalloc(sizeof(khash_tss_subt_t), GFP_KERNEL);
+	if (unlikely(!subt))
+		return (NULL);
+
+	subt->hits = alloc_percpu(uint64_t);
+	if (unlikely(!subt->hits))
+		goto khash_tss_subt_new_fail;
+
+	subt->kh = khash_init(tss->bck_size);
+	if (unlikely(!subt->kh))
+		goto khash_tss_subt_new_fail;
+
+	subt->mask = mask;
+
+	return (subt);
+
+khash_tss_subt_new_fail:
+	free_percpu(subt->hits);
+	kfree(subt);
+	return (NULL);
+}
+
+static void
+khash_tss_subt_free(khash_tss_subt_t *subt)
+{
+	khash_term(subt->kh);
+	free_percpu(subt->hits);
+	kfree(subt);
+}
+
+static void
+khash_tss_subt_free_rcu(struct rcu_head *rcu)
+{
+	khash_tss_subt_free(container_of(rcu, khash_tss_subt_t, rcu));
+}
+
+static khash_tss_subt_t *
+khash_tss_subt_find(khash_tss_t *tss, uint64_t mask)
+{
+	khash_tss_vec_t *vec = khash_tss_vec_get(tss);
+	uint32_t i;
+
+	for (i = 0; vec && i < vec->n; i++) {
+		if (vec->subt[i]->mask == mask)
+			return (vec->subt[i]);
+	}
+
+	return (NULL);
+}
+
+khash_tss_t *
+khash_tss_init(uint32_t bck_size)
+{
+	khash_tss_t *tss = NULL;
+
+	tss = kzalloc(sizeof(khash_tss_t), GFP_KERNEL);
+	if (unlikely(!tss))
+		return (NULL);
+
+	tss->bck_size = bck_size;
+
+	return (tss);
+}
+EXPORT_SYMBOL(khash_tss_init);
+
+static int
+khash_tss_rule_free(khash_key_t hash, void *value, void *user_data)
+{
+	kfree_rcu((khash_tss_rule_t *)value, rcu);
+
+	return (0);
+}
+
+void
+khash_tss_term(khash_tss_t *tss)
+{
+	khash_tss_vec_t *vec = NULL;
+	uint32_t i;
+
+	if (unlikely(!tss))
+		return;
+
+	vec = khash_tss_vec_get(tss);
+	RCU_INIT_POINTER(tss->vec, NULL);
+
+	if (vec) {
+		synchronize_rcu();
+		for (i = 0; i < vec->n; i++) {
+			rcu_read_lock();
+			khash_foreach(vec->subt[i]->kh, khash_tss_rule_free, NULL);
+			rcu_read_unlock();
+			khash_tss_subt_free(vec->subt[i]);
+		}
+		kfree(vec);
+	}
+
+	kfree(tss);
+}
+EXPORT_SYMBOL(khash_tss_term);
+
+int
+khash_tss_add(khash_tss_t *tss, khash_key_t key, khash_key_t mask,
+		uint32_t priority, void *value, gfp_t flags)
+{
+	khash_tss_subt_t *subt = NULL;
+	khash_tss_rule_t *rule = NULL;
+	uint8_t new_subt = 0;
+
+	if (unlikely(!tss))
+		return (-1);
+
+	rule = kzalloc(sizeof(khash_tss_rule_t), flags);
+	if (unlikely(!rule))
+		return (-1);
+
+	rule->priority = priority;
+	rule->value = value;
+
+	subt = khash_tss_subt_find(tss, mask.__key._64);
+	if (!subt) {
+		subt = khash_tss_subt_new(tss, mask.__key._64);
+		if (unlikely(!subt))
+			goto khash_tss_add_fail;
+		new_subt = 1;
+	}
+
+	if (khash_addentry(subt->kh, khash_tss_key(key, subt->mask), rule,
+			flags) < 0)
+		goto khash_tss_add_fail;
+
+	subt->count++;
+	tss->count++;
+
+	if (!new_subt && priority <= subt->prio)
+		return (0);
+
+	/* The probing order depends on prio: publish a re-sorted one */
+	subt->prio = max(subt->prio, priority);
+	WRITE_ONCE(subt->max_prio, max(subt->max_prio, priority));
+	if (khash_tss_vec_update(tss, new_subt ? subt : NULL, NULL, flags) < 0) {
+		khash_rementry(subt->kh, khash_tss_key(key, subt->mask), NULL);
+		subt->count--;
+		tss->count--;
+		if (new_subt) {
+			khash_tss_subt_free(subt);
+			kfree(rule);
+			return (-1);
+		}
+		/* rule has been published: wait for readers */
+		kfree_rcu(rule, rcu);
+		return (-1);
+	}
+
+	return (0);
+
+khash_tss_add_fail:
+	if (new_subt)
+		khash_tss_subt_free(subt);
+	kfree(rule);
+	return (-1);
+}
+EXPORT_SYMBOL(khash_tss_add);
+
+int
+khash_tss_del(khash_tss_t *tss, khash_key_t key, khash_key_t mask,
+		void **retval)
+{
+	khash_tss_subt_t *subt = NULL;
+	khash_tss_rule_t *rule = NULL;
+
+	if (unlikely(!tss))
+		goto khash_tss_del_fail;
+
+	subt = khash_tss_subt_find(tss, mask.__key._64);
+	if (!subt)
+		goto khash_tss_del_fail;
+
+	if (khash_rementry(subt->kh, khash_tss_key(key, subt->mask),
+			(void **)&rule) < 0)
+		goto khash_tss_del_fail;
+
+	subt->count--;
+	tss->count--;
+
+	if (retval)
+		*retval = rule->value;
+	kfree_rcu(rule, rcu);
+
+	/* max_prio is an upper bound and is refreshed by khash_tss_rank() */
+	if (!subt->count &&
+			khash_tss_vec_update(tss, NULL, subt, GFP_ATOMIC) == 0)
+		call_rcu(&subt->rcu, khash_tss_subt_free_rcu);
+
+	return (0);
+
+khash_tss_del_fail:
+	if (retval)
+		*retval = NULL;
+	return (-1);
+}
+EXPORT_SYMBOL(khash_tss_del);
+
+int
+khash_tss_lookup(khash_tss_t *tss, khash_key_t key, void **retval)
+{
+	khash_tss_rule_t *best = NULL;
+	khash_tss_rule_t *rule = NULL;
+	khash_tss_subt_t *subt = NULL;
+	khash_tss_vec_t *vec = NULL;
+	uint32_t i;
+
+	if (unlikely(!tss))
+		goto khash_tss_lookup_fail;
+
+	vec = rcu_dereference(tss->vec);
+	for (i = 0; vec && i < vec->n; i++) {
+		subt = vec->subt[i];
+
+		/* Nothing left can beat the current match */
+		if (best && best->priority >= READ_ONCE(subt->max_prio))
+			break;
+
+		if (khash_lookup(subt->kh, khash_tss_key(key, subt->mask),
+				(void **)&rule) < 0)
+			continue;
+
+		this_cpu_inc(*subt->hits);
+
+		if (!best || rule->priority > best->priority)
+			best = rule;
+	}
+
+	if (!best)
+		goto khash_tss_lookup_fail;
+
+	if (retval)
+		*retval = best->value;
+	return (0);
+
+khash_tss_lookup_fail:
+	if (retval)
+		*retval = NULL;
+	return (-1);
+}
+EXPORT_SYMBOL(khash_tss_lookup);
+
+int
+khash_tss_size(khash_tss_t *tss)
+{
+	if (unlikely(!tss))
+		return (-1);
+
+	return (tss->count);
+}
+EXPORT_SYMBOL(khash_tss_size);
+
+int
+khash_tss_subtables(khash_tss_t *tss)
+{
+	khash_tss_vec_t *vec = NULL;
+
+	if (unlikely(!tss))
+		return (-1);
+
+	vec = khash_tss_vec_get(tss);
+
+	return (vec ? vec->n : 0);
+}
+EXPORT_SYMBOL(khash_tss_subtables);
+
+static int
+khash_tss_max_prio(khash_key_t hash, void *value, void *user_data)
+{
+	khash_tss_rule_t *rule = (khash_tss_rule_t *)value;
+	uint32_t *max_prio = (uint32_t *)user_data;
+
+	if (rule->priority > *max_prio)
+		*max_prio = rule->priority;
+
+	return (0);
+}
+
+/*
+ * Refresh max_prio of every subtable and re-sort them by the hits they
+ * collected since the previous call. Meant to be run periodically.
+ *
+ * A lowered bound is only published once no reader can walk the previous
+ * order anymore: in that one a lower max_prio could stop a lookup before
+ * the subtables holding a better match.
+ */
+int
+khash_tss_rank(khash_tss_t *tss)
+{
+	khash_tss_subt_t *subt = NULL;
+	khash_tss_vec_t *vec = NULL;
+	uint64_t hits;
+	uint32_t i, prio, lowered = 0;
+	int cpu;
+
+	if (unlikely(!tss))
+		return (-1);
+
+	might_sleep();
+
+	vec = khash_tss_vec_get(tss);
+	if (!vec)
+		return (0);
+
+	for (i = 0; i < vec->n; i++) {
+		subt = vec->subt[i];
+
+		hits = 0;
+		for_each_possible_cpu(cpu)
+			hits += *per_cpu_ptr(subt->hits, cpu);
+
+		subt->hits_rate = hits - subt->hits_last;
+		subt->hits_last = hits;
+
+		prio = 0;
+		rcu_read_lock();
+		khash_foreach(subt->kh, khash_tss_max_prio, &prio);
+		rcu_read_unlock();
+
+		if (prio < subt->prio)
+			lowered = 1;
+		subt->prio = prio;
+	}
+
+	/* On failure the order in place still holds, max_prio is untouched */
+	if (khash_tss_vec_update(tss, NULL, NULL, GFP_KERNEL) < 0)
+		return (-1);
+
+	if (!lowered)
+		return (0);
+
+	synchronize_rcu();
+
+	vec = khash_tss_vec_get(tss);
+	for (i = 0; i < vec->n; i++)
+		WRITE_ONCE(vec->subt[i]->max_prio, vec->subt[i]->prio);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_tss_rank);
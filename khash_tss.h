@@ -0,0 +1,52 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef KHASH_TSS_H
+#define KHASH_TSS_H
+
+/*
+ * Tuple space search: rules are (key, mask, priority) triples, with one
+ * khash subtable per distinct mask. Keys are matched on their raw 64 bit
+ * value (khash_key_t.__key), masked and re-hashed per subtable, so they
+ * have to be built by khash_hash_u32/u64/ipaddr() or equivalent.
+ *
+ * Lookups run under rcu_read_lock(); add/del/rank MUST be serialized by
+ * the caller; adding a rule with a new mask and ranking need non atomic
+ * context.
+ */
+
+typedef struct khash_tss_t khash_tss_t;
+
+khash_tss_t *khash_tss_init(uint32_t bck_size);
+void khash_tss_term(khash_tss_t *tss);
+
+int khash_tss_add(khash_tss_t *tss, khash_key_t key, khash_key_t mask,
+		uint32_t priority, void *value, gfp_t flags);
+int khash_tss_del(khash_tss_t *tss, khash_key_t key, khash_key_t mask,
+		void **retval);
+int khash_tss_lookup(khash_tss_t *tss, khash_key_t key, void **retval);
+
+int khash_tss_size(khash_tss_t *tss);
+int khash_tss_subtables(khash_tss_t *tss);
+int khash_tss_rank(khash_tss_t *tss);
+
+#endif
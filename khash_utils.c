@@ -26,6 +26,11 @@
 #include <linux/in.h>
 #include <linux/in6.h>
 #include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
 #include <linux/jhash.h>
 
 #include "khash.h"
@@ -127,3 +132,220 @@ khash_hash_ipaddr(uint16_t sa_family, uint32_t *addr)
 
 	return (hash);
 }
+
+/* Returns the offset of the L4 header, -1 if missing or a fragment */
+static int
+khash_skb_l3(const struct sk_buff *skb, khash_tuple_t *tuple)
+{
+	int off = skb_network_offset(skb);
+	struct ipv6hdr _ip6h, *ip6h = NULL;
+	struct frag_hdr _fh, *fh = NULL;
+	struct iphdr _iph, *iph = NULL;
+	unsigned int foff = 0;
+	__be16 frag_off = 0;
+	uint8_t nexthdr;
+
+	memset(tuple, 0, sizeof(khash_tuple_t));
+
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		iph = skb_header_pointer(skb, off, sizeof(_iph), &_iph);
+		if (unlikely(!iph || iph->ihl < 5))
+			return (-1);
+
+		tuple->family = AF_INET;
+		tuple->proto = iph->protocol;
+		tuple->saddr[0] = iph->saddr;
+		tuple->daddr[0] = iph->daddr;
+
+		return (ip_is_fragment(iph) ? -1 : off + iph->ihl * 4);
+	case htons(ETH_P_IPV6):
+		ip6h = skb_header_pointer(skb, off, sizeof(_ip6h), &_ip6h);
+		if (unlikely(!ip6h))
+			return (-1);
+
+		tuple->family = AF_INET6;
+		memcpy(tuple->saddr, &ip6h->saddr, sizeof(tuple->saddr));
+		memcpy(tuple->daddr, &ip6h->daddr, sizeof(tuple->daddr));
+
+		/*
+		 * ipv6_skip_exthdr() reports frag_off 0 for the first fragment:
+		 * look for the Fragment header itself, as ip_is_fragment() does,
+		 * and key every fragment by what it carries
+		 */
+		if (ipv6_find_hdr(skb, &foff, NEXTHDR_FRAGMENT, NULL, NULL) ==
+				NEXTHDR_FRAGMENT) {
+			fh = skb_header_pointer(skb, foff, sizeof(_fh), &_fh);
+			if (likely(fh))
+				tuple->proto = fh->nexthdr;
+			return (-1);
+		}
+
+		nexthdr = ip6h->nexthdr;
+		off = ipv6_skip_exthdr(skb, off + sizeof(_ip6h), &nexthdr, &frag_off);
+		tuple->proto = nexthdr;
+
+		return (off);
+	}
+
+	return (-1);
+}
+
+/* Returns the offset of the ports, 0 if there are none, -1 on failure */
+static int
+khash_skb_l4(const struct sk_buff *skb, khash_tuple_t *tuple)
+{
+	__be16 _ports[2], *ports = NULL;
+	int off;
+
+	if (!skb)
+		return (-1);
+
+	off = khash_skb_l3(skb, tuple);
+	if (off < 0)
+		return (tuple->family ? 0 : -1);
+
+	switch (tuple->proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+		ports = skb_header_pointer(skb, off, sizeof(_ports), _ports);
+		if (unlikely(!ports))
+			return (-1);
+
+		tuple->sport = ports[0];
+		tuple->dport = ports[1];
+		return (off);
+	}
+
+	return (0);
+}
+
+int
+khash_skb_tuple(const struct sk_buff *skb, khash_tuple_t *tuple)
+{
+	if (unlikely(!tuple))
+		return (-1);
+
+	return (khash_skb_l4(skb, tuple) < 0 ? -1 : 0);
+}
+EXPORT_SYMBOL(khash_skb_tuple);
+
+/* Match half of the key, every word rotated apart to keep fields apart */
+__always_inline static uint64_t
+khash_tuple_fold(const khash_tuple_t *tuple)
+{
+	const uint64_t *w = (const uint64_t *)tuple;
+
+	return (w[0] ^ rol64(w[1], 13) ^ rol64(w[2], 26) ^ rol64(w[3], 39) ^
+			rol64(w[4], 52));
+}
+
+khash_key_t
+khash_hash_tuple(const khash_tuple_t *tuple)
+{
+	khash_key_t hash = {};
+
+	if (unlikely(!tuple))
+		return (hash);
+
+	hash.key = jhash2((const u32 *)tuple, sizeof(khash_tuple_t) / sizeof(u32),
+			JHASH_INITVAL);
+	hash.__key._64 = khash_tuple_fold(tuple);
+
+	return (hash);
+}
+EXPORT_SYMBOL(khash_hash_tuple);
+
+int
+khash_tuple_match(const khash_tuple_t *a, const khash_tuple_t *b)
+{
+	return (!memcmp(a, b, sizeof(khash_tuple_t)));
+}
+EXPORT_SYMBOL(khash_tuple_match);
+
+int
+khash_hash_skb(const struct sk_buff *skb, khash_key_t *hash)
+{
+	khash_tuple_t tuple;
+
+	if (unlikely(!hash || khash_skb_l4(skb, &tuple) < 0))
+		return (-1);
+
+	*hash = khash_hash_tuple(&tuple);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_hash_skb);
+
+int
+khash_hash_skb_rss(const struct sk_buff *skb, khash_key_t *hash)
+{
+	khash_tuple_t tuple;
+
+	/* Never fall back to another hash space: the flow would move */
+	if (unlikely(!hash || !skb->l4_hash || khash_skb_l4(skb, &tuple) < 0))
+		return (-1);
+
+	hash->key = skb->hash;
+	hash->__key._64 = khash_tuple_fold(&tuple);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_hash_skb_rss);
+
+/* GTPv1-U header, TS 29.281 */
+typedef struct {
+	uint8_t flags;
+	uint8_t type;
+	__be16 length;
+	__be32 teid;
+} khash_gtpu_hdr_t;
+
+#define KHASH_GTPU_V1   0x20 /* Version 1, bits 5-7 */
+#define KHASH_GTPU_PT   0x10 /* GTP, not GTP' */
+#define KHASH_GTPU_GPDU 0xff /* User payload, the only one with a flow TEID */
+
+int
+khash_skb_teid(const struct sk_buff *skb, uint32_t *teid)
+{
+	khash_gtpu_hdr_t _gtph, *gtph = NULL;
+	khash_tuple_t tuple;
+	int off;
+
+	if (unlikely(!teid))
+		return (-1);
+
+	off = khash_skb_l4(skb, &tuple);
+	if (off <= 0 || tuple.proto != IPPROTO_UDP ||
+			tuple.dport != htons(KHASH_GTPU_PORT))
+		return (-1);
+
+	gtph = skb_header_pointer(skb, off + sizeof(struct udphdr), sizeof(_gtph),
+			&_gtph);
+	if (unlikely(!gtph) ||
+			(gtph->flags & 0xf0) != (KHASH_GTPU_V1 | KHASH_GTPU_PT) ||
+			gtph->type != KHASH_GTPU_GPDU)
+		return (-1);
+
+	*teid = ntohl(gtph->teid);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_skb_teid);
+
+/* The RSS hash only covers the outer ports, useless to spread tunnels */
+int
+khash_hash_skb_teid(const struct sk_buff *skb, khash_key_t *hash)
+{
+	uint32_t teid;
+
+	if (unlikely(!hash || khash_skb_teid(skb, &teid) < 0))
+		return (-1);
+
+	*hash = khash_hash_u32(teid);
+
+	return (0);
+}
+EXPORT_SYMBOL(khash_hash_skb_teid);
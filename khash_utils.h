@@ -37,4 +37,44 @@ khash_key_t khash_hash_u32(uint32_t key);
 khash_key_t khash_hash_u64(uint64_t key);
 khash_key_t khash_hash_aligned32(uint32_t *key, int lkey);
 
+struct sk_buff;
+
+/* Flow 5-tuple, IPv4 addresses in the first word of saddr/daddr */
+typedef struct {
+	__be32 saddr[4];
+	__be32 daddr[4];
+	__be16 sport;
+	__be16 dport;
+	uint8_t proto;
+	uint8_t family;
+	uint16_t pad;
+} __aligned(8) khash_tuple_t;
+
+#define KHASH_GTPU_PORT 2152
+
+/*
+ * Tuple keys are a 96 bit digest of the tuple, not the tuple: digests are
+ * not collision resistant and colliding tuples can be crafted, so values
+ * MUST carry their tuple and lookups MUST check it with
+ * khash_tuple_match() before trusting a hit.
+ */
+int khash_skb_tuple(const struct sk_buff *skb, khash_tuple_t *tuple);
+khash_key_t khash_hash_tuple(const khash_tuple_t *tuple);
+int khash_tuple_match(const khash_tuple_t *a, const khash_tuple_t *b);
+int khash_skb_teid(const struct sk_buff *skb, uint32_t *teid);
+
+/*
+ * Keys straight from the packet, -1 when it has no such key. Fragments,
+ * the first one included, get zero ports; khash_skb_teid() only accepts
+ * G-PDU messages (echo and other signalling fail). khash_hash_skb()
+ * equals khash_hash_tuple() of the packet tuple. khash_hash_skb_rss()
+ * saves the software hash by taking skb->hash as the bucket hash, and
+ * fails when that does not cover the L4 ports: a table keyed by it has to
+ * be keyed by it alone, by packets hashed by the same NIC (or dissector),
+ * and never by khash_hash_tuple() or the ctl device.
+ */
+int khash_hash_skb(const struct sk_buff *skb, khash_key_t *hash);
+int khash_hash_skb_rss(const struct sk_buff *skb, khash_key_t *hash);
+int khash_hash_skb_teid(const struct sk_buff *skb, khash_key_t *hash);
+
 #endif
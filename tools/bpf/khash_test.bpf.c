@@ -0,0 +1,186 @@
+/*
+ * KHASH
+ * An ultra fast hash table in kernel space based on hashtable.h
+ * Copyright (C) 2016-2017 - Athonet s.r.l. - All Rights Reserved
+ *
+ * Authors:
+ *         Paolo Missiaggia, <paolo.Missiaggia@athonet.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Exercise the khash kfuncs on the "khash_bpf_test" table (khash loaded
+ * with bpf_selftest=1) from XDP and tc. Every UDP datagram to
+ * KHASH_TEST_PORT carries a khash_test_req: the program runs lookup,
+ * update, replace and delete on its key and accounts the outcome in
+ * khash_test_res. Built and driven by veth_test.sh.
+ */
+
+#include <linux/types.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/in.h>
+#include <linux/udp.h>
+#include <linux/pkt_cls.h>
+#include <asm-generic/errno-base.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "khash_bpf.h"
+
+#define KHASH_TEST_PORT 9000
+
+/* Host byte order, as written by veth_test.sh */
+struct khash_test_req {
+	__u32 id;
+	__u32 pad;
+	__u64 key;
+};
+
+struct khash_test_res {
+	__u64 runs;
+	__u64 passed;
+	__s32 step;   /* First failed step of the last failed run */
+	__s32 ret;    /* What it returned */
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct khash_test_res);
+} khash_test_res SEC(".maps");
+
+static __always_inline struct khash_test_req *
+khash_test_parse(void *data, void *data_end)
+{
+	struct ethhdr *eth = data;
+	struct iphdr *iph = NULL;
+	struct udphdr *udph = NULL;
+	struct khash_test_req *req = NULL;
+
+	if ((void *)(eth + 1) > data_end || eth->h_proto != bpf_htons(ETH_P_IP))
+		return (NULL);
+
+	iph = (struct iphdr *)(eth + 1);
+	if ((void *)(iph + 1) > data_end || iph->protocol != IPPROTO_UDP ||
+			iph->ihl != 5)
+		return (NULL);
+
+	udph = (struct udphdr *)(iph + 1);
+	if ((void *)(udph + 1) > data_end ||
+			udph->dest != bpf_htons(KHASH_TEST_PORT))
+		return (NULL);
+
+	req = (struct khash_test_req *)(udph + 1);
+	if ((void *)(req + 1) > data_end)
+		return (NULL);
+
+	return (req);
+}
+
+/* 0 or the failed step, *ret being what it returned */
+static __always_inline int
+khash_test_steps(__u32 id, __u64 key, int *ret)
+{
+	__u64 value = 0;
+
+	*ret = bpf_khash_lookup(id, key, 0, 0, &value);
+	if (*ret != -ENOENT)
+		return (1);
+
+	*ret = bpf_khash_update(id, key, 0, 0, key ^ 1);
+	if (*ret)
+		return (2);
+
+	*ret = bpf_khash_lookup(id, key, 0, 0, &value);
+	if (*ret || value != (key ^ 1))
+		return (3);
+
+	/* Replace, as BPF_ANY */
+	*ret = bpf_khash_update(id, key, 0, 0, key ^ 2);
+	if (*ret)
+		return (4);
+
+	*ret = bpf_khash_lookup(id, key, 0, 0, &value);
+	if (*ret || value != (key ^ 2))
+		return (5);
+
+	*ret = bpf_khash_delete(id, key, 0, 0);
+	if (*ret)
+		return (6);
+
+	*ret = bpf_khash_lookup(id, key, 0, 0, &value);
+	if (*ret != -ENOENT)
+		return (7);
+
+	*ret = bpf_khash_delete(id, key, 0, 0);
+	if (*ret != -ENOENT)
+		return (8);
+
+	return (0);
+}
+
+/* 1 when the packet was a test request */
+static __always_inline int
+khash_test_run(void *data, void *data_end)
+{
+	struct khash_test_req *req = khash_test_parse(data, data_end);
+	struct khash_test_res *res = NULL;
+	__u32 zero = 0;
+	int step, ret = 0;
+
+	if (!req)
+		return (0);
+
+	res = bpf_map_lookup_elem(&khash_test_res, &zero);
+	if (!res)
+		return (1);
+
+	step = khash_test_steps(req->id, req->key, &ret);
+
+	__sync_fetch_and_add(&res->runs, 1);
+	if (!step) {
+		__sync_fetch_and_add(&res->passed, 1);
+	} else {
+		res->step = step;
+		res->ret = ret;
+	}
+
+	return (1);
+}
+
+SEC("xdp")
+int
+khash_test_xdp(struct xdp_md *ctx)
+{
+	void *data = (void *)(long)ctx->data;
+	void *data_end = (void *)(long)ctx->data_end;
+
+	return (khash_test_run(data, data_end) ? XDP_DROP : XDP_PASS);
+}
+
+SEC("tc")
+int
+khash_test_tc(struct __sk_buff *skb)
+{
+	void *data = (void *)(long)skb->data;
+	void *data_end = (void *)(long)skb->data_end;
+
+	return (khash_test_run(data, data_end) ? TC_ACT_SHOT : TC_ACT_OK);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,191 @@
+#!/usr/bin/env bash
+
+set -e
+
+# Usage
+usage(){
+    PADDING=$(echo $(basename $0) | sed 's/./ /g' )
+    echo "$(basename $0)"
+    echo
+    echo "run the khash kfuncs over a local veth pair, from XDP and tc"
+    echo
+    echo "options:"
+    echo "$PADDING -k khash.ko  load the module (with bpf_selftest=1) if needed"
+    echo "$PADDING -m mode      xdp, tc or all (default)"
+    echo "$PADDING -n packets   requests per mode (default 64)"
+    echo "$PADDING -o outdir    where to build the BPF object (default /tmp)"
+    exit
+}
+
+# Parse Optional Arguments
+ROOTPATH="$(cd $(dirname $0)/../.. && pwd)"
+KO=""
+MODE=all
+PACKETS=64
+OUTDIR=/tmp
+HELP=false
+
+NS=khash_test
+VETH=khv0
+VETH_PEER=khv1
+ADDR=10.111.0.1
+ADDR_PEER=10.111.0.2
+PORT=9000
+DBG=/sys/kernel/debug/khash/khash_bpf_test
+
+while getopts "k:m:n:o:h" OPTION
+do
+	case $OPTION in
+        k)
+            KO=$(realpath $OPTARG)
+            ;;
+        m)
+            MODE=$OPTARG
+            ;;
+        n)
+            PACKETS=$OPTARG
+            ;;
+        o)
+            OUTDIR=$(realpath $OPTARG)
+            ;;
+        h)
+            HELP=true        # get help usage
+            ;;
+	esac
+done
+
+if [[ $HELP == true ]];then
+    usage
+fi
+
+if [[ $EUID -ne 0 ]]; then
+    echo "[!] you must be root to run the test"
+    exit 127
+fi
+
+for tool in clang bpftool ip tc python3; do
+    if ! command -v $tool > /dev/null; then
+        echo "[!] $tool not found"
+        exit 127
+    fi
+done
+
+OBJ="$OUTDIR/khash_test.bpf.o"
+
+cleanup(){
+    ip link del $VETH 2> /dev/null || :
+    ip netns del $NS 2> /dev/null || :
+}
+
+# Little endian bytes of $1 over $2 bytes, as printf escapes
+le(){
+    local out="" i
+    for ((i = 0; i < $2; i++)); do
+        out+=$(printf '\\x%02x' $(( ($1 >> (8 * i)) & 0xff )))
+    done
+    echo -n "$out"
+}
+
+# khash_test_res of the program named $1: runs passed step ret
+result(){
+    local map_id
+    map_id=$(bpftool -j prog show name $1 | python3 -c '
+import json, sys
+p = json.load(sys.stdin)
+p = p[0] if isinstance(p, list) else p
+print(p["map_ids"][0])')
+
+    bpftool -j map lookup id $map_id key 0 0 0 0 | python3 -c '
+import json, struct, sys
+d = json.load(sys.stdin)
+d = d[0] if isinstance(d, list) else d
+v = d.get("formatted", d)["value"]
+if isinstance(v, dict):
+    print(v["runs"], v["passed"], v["step"], v["ret"])
+else:
+    print(*struct.unpack("<QQii", bytes(int(x, 16) for x in v)))'
+}
+
+run(){
+    local mode=$1 prog=khash_test_$1 id key i
+    local runs passed step ret
+
+    if [[ $mode == xdp ]];then
+        ip -n $NS link set dev $VETH_PEER xdp obj $OBJ sec xdp
+    else
+        ip netns exec $NS tc qdisc add dev $VETH_PEER clsact
+        ip netns exec $NS tc filter add dev $VETH_PEER ingress bpf \
+            direct-action obj $OBJ sec tc
+    fi
+
+    id=$(cat $DBG/id)
+    for ((i = 0; i < PACKETS; i++)); do
+        key=$(( (RANDOM << 30) | (RANDOM << 15) | RANDOM ))
+        printf "$(le $id 4)$(le 0 4)$(le $key 8)" > /dev/udp/$ADDR_PEER/$PORT
+    done
+    sleep 1
+
+    read runs passed step ret < <(result $prog)
+
+    if [[ $mode == xdp ]];then
+        ip -n $NS link set dev $VETH_PEER xdp off
+    else
+        ip netns exec $NS tc qdisc del dev $VETH_PEER clsact
+    fi
+
+    if [[ $runs -ne $PACKETS || $passed -ne $PACKETS ]];then
+        echo "[!] $mode: $passed/$runs passed of $PACKETS sent, step $step returned $ret"
+        return 1
+    fi
+
+    echo "[khash: $mode] $passed/$PACKETS ok"
+}
+
+# Module, its test table and the BPF id of the latter
+if [[ ! -d /sys/module/khash ]];then
+    if [[ -z "$KO" ]];then
+        echo "[!] khash not loaded, pass its module with -k"
+        exit 127
+    fi
+    insmod $KO bpf_selftest=1
+fi
+
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+
+if [[ ! -e $DBG/id ]];then
+    echo "[!] no test table: khash has to be loaded with bpf_selftest=1 on a 6.9+ kernel with BTF"
+    exit 127
+fi
+
+if [[ $(cat $DBG/id) -ge 64 ]];then
+    echo "[!] no BPF id left for the test table"
+    exit 127
+fi
+
+clang -O2 -g -target bpf -I$ROOTPATH -c $ROOTPATH/tools/bpf/khash_test.bpf.c -o $OBJ
+
+trap cleanup EXIT
+cleanup
+
+ip netns add $NS
+ip link add $VETH type veth peer name $VETH_PEER netns $NS
+ip addr add $ADDR/24 dev $VETH
+ip link set dev $VETH up
+ip -n $NS addr add $ADDR_PEER/24 dev $VETH_PEER
+ip -n $NS link set dev $VETH_PEER up
+ip -n $NS link set dev lo up
+
+case "${MODE}" in
+    xdp|tc)
+        run $MODE
+        ;;
+    all)
+        run xdp
+        run tc
+        ;;
+    *)
+        usage
+        ;;
+esac
+
+echo "[khash: bpf] ok"